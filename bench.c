@@ -0,0 +1,1193 @@
+//  printfq-bench
+//  Measure the throughput of the printfq escaping engines.  Each corpus is generated from a
+// fixed seed, so the results are comparable between builds on the same machine.  Every corpus is
+// escaped with each combination of options in each available character set, and the output is
+// counted and discarded.  It can also check the output against the reference build of the
+// library, with -v or as a fuzzing harness with PRINTFQ_FUZZ.  With -x, it instead measures how
+// long printfq builds take to start and escape a short argument.
+
+#define _GNU_SOURCE
+#include "printfq.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <locale.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define DEFAULT_CORPUS_SIZE (4 * 1024 * 1024)
+#define DEFAULT_SECONDS 0.2
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+//  The largest input and output pieces used when verifying
+#define MAXIMUM_CHUNK 64
+#define VERIFY_ROUNDS 4
+//  The fewest times that a program is started for -x
+#define MINIMUM_STARTUP_RUNS 10
+
+//  printfq version 3, from libprintfq-reference.c
+int printfq_reference_escape_stream(const printfq_opts * opts, printfq_input * in,
+	printfq_output * out);
+
+typedef int (* streamEscaper)(const printfq_opts * opts, printfq_input * in, printfq_output * out);
+
+//  xorshift64*, so that the corpora do not depend on the C library
+static uint64_t randomState;
+
+static uint32_t randomNext(void)
+{
+	randomState ^= randomState >> 12;
+	randomState ^= randomState << 25;
+	randomState ^= randomState >> 27;
+	return (randomState * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+static uint32_t randomBelow(uint32_t n)
+{
+	return (uint64_t)randomNext() * n >> 32;
+}
+
+//  Input that is handed to the engine in pieces of random sizes, so that characters and escapes
+// are split across refills
+struct chunkedInput {
+	printfq_input in;
+	const unsigned char * next;
+	const unsigned char * last;
+	unsigned char buf[2 * MAXIMUM_CHUNK];
+};
+
+static ssize_t chunkedRefill(printfq_input * in)
+{
+	struct chunkedInput * chunked = (struct chunkedInput *)in;
+	size_t pending = in->end - in->pos;
+	size_t size = 1 + randomBelow(MAXIMUM_CHUNK);
+	if(size > (size_t)(chunked->last - chunked->next))
+		size = chunked->last - chunked->next;
+	if(size > sizeof(chunked->buf) - pending)
+		size = sizeof(chunked->buf) - pending;
+	memmove(chunked->buf, in->pos, pending);
+	memcpy(chunked->buf + pending, chunked->next, size);
+	chunked->next += size;
+	in->pos = chunked->buf;
+	in->end = chunked->buf + pending + size;
+	return size;
+}
+
+//  Output that is kept for comparison.  When chunked, the buffer size changes randomly at each
+// flush, and the write hook is only sometimes used.
+struct collectingOutput {
+	printfq_output out;
+	char * data;
+	size_t length;
+	size_t cap;
+	unsigned chunked;
+	char buf[OUTPUT_BUFFER_SIZE];
+};
+
+static int collect(struct collectingOutput * c, const void * ptr, size_t size)
+{
+	if(size > c->cap - c->length) {
+		size_t cap = c->cap ? c->cap : OUTPUT_BUFFER_SIZE;
+		while(size > cap - c->length)
+			cap <<= 1;
+		char * data = realloc(c->data, cap);
+		if(! data)
+			return -1;
+		c->data = data;
+		c->cap = cap;
+	}
+	memcpy(c->data + c->length, ptr, size);
+	c->length += size;
+	return 0;
+}
+
+static int collectingFlush(printfq_output * out)
+{
+	struct collectingOutput * c = (struct collectingOutput *)out;
+	if(collect(c, out->buf, out->pos - out->buf))
+		return -1;
+	out->pos = out->buf;
+	if(c->chunked)
+		out->end = out->buf + 1 + randomBelow(MAXIMUM_CHUNK);
+	return 0;
+}
+
+static int collectingWrite(printfq_output * out, const void * ptr, size_t size)
+{
+	return collectingFlush(out) || collect((struct collectingOutput *)out, ptr, size) ? -1 : 0;
+}
+
+static void collectingReset(struct collectingOutput * c, unsigned chunked)
+{
+	c->length = 0;
+	c->chunked = chunked;
+	c->out = (printfq_output){
+		.buf = c->buf,
+		.pos = c->buf,
+		.end = c->buf + (chunked ? 1 + randomBelow(MAXIMUM_CHUNK) : sizeof(c->buf)),
+		.flush = collectingFlush,
+		.write = ! chunked || randomBelow(2) ? collectingWrite : NULL
+	};
+}
+
+//  Decode the escaped output in random pieces, and compare it to the strings of the corpus, each
+// null terminated.  Returns 0 when they match, 2 with offset set to the first difference when they
+// do not, or -1 with errno set on error.
+static int verifyDecoding(const printfq_opts * opts, const unsigned char * corpus, size_t length,
+	const char * escaped, size_t escapedLength, size_t * offset)
+{
+	static struct collectingOutput output;
+	static struct chunkedInput input;
+	input.in = (printfq_input){.pos = input.buf, .end = input.buf, .refill = chunkedRefill};
+	input.next = (const unsigned char *)escaped;
+	input.last = (const unsigned char *)escaped + escapedLength;
+	collectingReset(&output, 1);
+	if(printfq_decode_stream(opts, &input.in, &output.out) && EILSEQ != errno)
+		return -1;
+	//  All of the input is one string with PRINTFQ_IGNORE_NULL_INPUT, which drops null characters
+	const unsigned whole = opts->flags & PRINTFQ_IGNORE_NULL_INPUT;
+	size_t idx = 0;
+	for(*offset = 0; idx < length; idx++)
+		if(! whole || corpus[idx])
+			if(*offset >= output.length || (char)corpus[idx] != output.data[(*offset)++])
+				return 2;
+	if(whole || ! length || corpus[length - 1])
+		if(*offset >= output.length || output.data[(*offset)++])
+			return 2;
+	return *offset == output.length ? 0 : 2;
+}
+
+//  Return the length of the UTF-8 character at p, or 0 if it is not properly encoded
+static size_t utf8Length(const unsigned char * p, const unsigned char * end)
+{
+	size_t size = 0x80 > *p ? 1 : 0xC2 > *p ? 0 : 0xE0 > *p ? 2 : 0xF0 > *p ? 3 : 0xF5 > *p ? 4 : 0;
+	if((size_t)(end - p) < size)
+		return 0;
+	for(size_t idx = 1; idx < size; idx++)
+		if(0x80 != (p[idx] & 0xC0))
+			return 0;
+	//  Overlong sequences, surrogates, and code points above 0x10FFFF
+	if((0xE0 == *p && 0xA0 > p[1]) || (0xED == *p && 0x9F < p[1]) || (0xF0 == *p && 0x90 > p[1]) ||
+		(0xF4 == *p && 0x8F < p[1]))
+		return 0;
+	return size;
+}
+
+//  Copy the strings of the corpus that are entirely UTF-8, each with its null terminator, if any,
+// to valid, and return their length.  printfq version 3 loses or misreads bytes around some
+// improperly encoded sequences, so only these are compared to it in a UTF-8 locale.
+static size_t validStrings(const unsigned char * corpus, size_t length, unsigned char * valid)
+{
+	const unsigned char * end = corpus + length;
+	unsigned char * v = valid;
+	for(const unsigned char * p = corpus; p < end;) {
+		const unsigned char * start = p;
+		size_t size = 1;
+		while(p < end && *p && (size = utf8Length(p, end)))
+			p += size;
+		while(p < end && *p++);
+		if(size) {
+			memcpy(v, start, p - start);
+			v += p - start;
+		}
+	}
+	return v - valid;
+}
+
+//  Escape the input to output, in random pieces through random output buffer sizes when chunked.
+// Returns 0 or the errno value from the engine.
+static int escapeInto(streamEscaper escape, const printfq_opts * opts, const unsigned char * input,
+	size_t length, unsigned chunked, struct collectingOutput * output)
+{
+	static struct chunkedInput chunkedInput;
+	printfq_input whole = {.pos = input, .end = input + length}, * in = &whole;
+	if(chunked) {
+		chunkedInput.in = (printfq_input){.pos = chunkedInput.buf, .end = chunkedInput.buf,
+			.refill = chunkedRefill};
+		chunkedInput.next = input;
+		chunkedInput.last = input + length;
+		in = &chunkedInput.in;
+	}
+	collectingReset(output, chunked);
+	return escape(opts, in, &output->out) ? errno : 0;
+}
+
+//  Set offset to the length of the common start of two outputs, and return whether they or their
+// errors differ
+static int compareOutputs(const struct collectingOutput * a, int aError,
+	const struct collectingOutput * b, int bError, size_t * offset)
+{
+	size_t size = a->length < b->length ? a->length : b->length;
+	for(*offset = 0; *offset < size && a->data[*offset] == b->data[*offset]; ++*offset);
+	return *offset != a->length || *offset != b->length || aError != bError;
+}
+
+//  Escape the corpus with the reference engine, and with the library, and compare the output and
+// the errors.  In a UTF-8 locale, that is only done for the strings that are properly encoded,
+// except with PRINTFQ_MINIMAL, and not at all with PRINTFQ_OPTIMIZE_OUTPUT_LENGTH, which the
+// reference engine does not have.  Then escape all of the corpus again in random pieces through
+// random output buffer sizes and check that the output is the same, and for ASCII and UTF-8, that
+// decoding it gives back the corpus.  Returns 0 when all of that matches, 1 with offset set to
+// the first difference from the reference output, 2 with offset set to the first difference in
+// the decoded output, or 3 with offset set to the first difference in the output in pieces, when
+// it does not, or -1 with errno set on error.
+static int verify(const printfq_opts * opts, const unsigned char * corpus, size_t length,
+	size_t * offset)
+{
+	static struct collectingOutput reference, whole, output;
+	static unsigned char * valid;
+	static size_t validCap;
+	int rc = 0, error = escapeInto(printfq_escape_stream, opts, corpus, length, 0, &whole);
+	int chunkedError = escapeInto(printfq_escape_stream, opts, corpus, length, 1, &output);
+	if(ENOMEM == error || ENOMEM == chunkedError)
+		goto noMemory;
+	if(compareOutputs(&whole, error, &output, chunkedError, offset))
+		return 3;
+	if(! (opts->flags & PRINTFQ_OPTIMIZE_OUTPUT_LENGTH)) {
+		const unsigned char * input = corpus;
+		size_t inputLength = length;
+		if(PRINTFQ_CHARSET_UTF8 == opts->charset && ! (opts->flags & PRINTFQ_MINIMAL)) {
+			if(validCap < length) {
+				free(valid);
+				validCap = 0;
+				if(! (valid = malloc(length)))
+					goto noMemory;
+				validCap = length;
+			}
+			input = valid;
+			inputLength = validStrings(corpus, length, valid);
+		}
+		int referenceError = escapeInto(printfq_reference_escape_stream, opts, input, inputLength, 0,
+			&reference);
+		int inputError = input == corpus ? error :
+			escapeInto(printfq_escape_stream, opts, input, inputLength, 0, &output);
+		if(ENOMEM == referenceError || ENOMEM == inputError)
+			goto noMemory;
+		if(compareOutputs(&reference, referenceError, input == corpus ? &whole : &output, inputError,
+			offset))
+			return 1;
+	}
+	//  In other character sets, non-printable characters are escaped as their UTF-8 encoding, so
+	// the corpus cannot be decoded back from the output
+	if(! error && PRINTFQ_CHARSET_UTF8 >= opts->charset &&
+		0 > (rc = verifyDecoding(opts, corpus, length, whole.data, whole.length, offset)))
+		return -1;
+	return rc;
+	noMemory:
+	errno = ENOMEM;
+	return -1;
+}
+
+//  Input that decoding must fail on with EILSEQ, since printfq never outputs it:  a null
+// character or another letter after a backslash in $'' quoting, out of range escapes, missing
+// digits, unterminated quotes, and shell syntax outside of quotes
+#define MALFORMED(s) {s, sizeof(s) - 1}
+static const struct malformedInput {
+	const char * input;
+	size_t length;
+} malformedInputs[] = {
+	MALFORMED("$'a\\\0b'"), MALFORMED("$'\\\0'"), MALFORMED("$'\\q'"), MALFORMED("$'\\x41'"),
+	MALFORMED("$'\\e'"), MALFORMED("$'\\c'"), MALFORMED("$'\\400'"), MALFORMED("$'\\u'"),
+	MALFORMED("$'\\ud800'"), MALFORMED("$'\\U110000'"), MALFORMED("$'\\"), MALFORMED("$'a"),
+	MALFORMED("'a"), MALFORMED("a\\"), MALFORMED("$a"), MALFORMED("a$"), MALFORMED("\"a\""),
+	MALFORMED("a`b"), MALFORMED("a|b")
+};
+#undef MALFORMED
+#define MALFORMED_COUNT (sizeof(malformedInputs) / sizeof(*malformedInputs))
+
+//  Return the number of malformedInputs that decoding does not fail on with EILSEQ
+static unsigned verifyMalformed(void)
+{
+	printfq_opts opts = {.charset = PRINTFQ_CHARSET_ASCII};
+	char buf[16];
+	unsigned accepted = 0;
+	for(size_t idx = 0; idx < MALFORMED_COUNT; idx++)
+		if((size_t)-1 != printfq_decode(malformedInputs[idx].input, malformedInputs[idx].length,
+			buf, sizeof(buf), &opts) || EILSEQ != errno)
+			accepted++;
+	return accepted;
+}
+
+#ifdef PRINTFQ_FUZZ
+//  libFuzzer entry points, which AFL++ also supports, in place of main().  The first byte of the
+// input holds the option flags, the second selects the character set and seeds the random
+// piece sizes, and the rest is verified against the reference engine.  The character set is
+// ASCII or UTF-8, in a UTF-8 locale, since the reference engine decides the character set from
+// the locale, and so decodes UTF-8 itself instead of with the C library.
+int LLVMFuzzerInitialize(int * argc, char *** argv);
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size);
+
+int LLVMFuzzerInitialize(int * argc, char *** argv)
+{
+	if(! setlocale(LC_CTYPE, "C.UTF-8"))
+		setlocale(LC_CTYPE, "en_US.UTF-8");
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+	printfq_opts opts;
+	size_t offset;
+	if(2 > size)
+		return 0;
+	printfq_opts_init(&opts, data[0]);
+	opts.charset = data[1] & 1;
+	randomState = 0x100 | data[1];
+	int rc = verify(&opts, data + 2, size - 2, &offset);
+	if(0 < rc) {
+		fprintf(stderr, 1 == rc ? "Output differs from the reference at byte %zu\n" :
+			2 == rc ? "Decoded output differs from the input at byte %zu\n" :
+			"Output in pieces differs at byte %zu\n", offset);
+		abort();
+	}
+	return 0;
+}
+#else
+
+static unsigned char * putUtf8(unsigned char * p, uint32_t c)
+{
+	if(0x80 > c)
+		*p++ = c;
+	else if(0x800 > c) {
+		*p++ = 0xC0 | c >> 6;
+		*p++ = 0x80 | (c & 0x3F);
+	}
+	else if(0x10000 > c) {
+		*p++ = 0xE0 | c >> 12;
+		*p++ = 0x80 | (c >> 6 & 0x3F);
+		*p++ = 0x80 | (c & 0x3F);
+	}
+	else {
+		*p++ = 0xF0 | c >> 18;
+		*p++ = 0x80 | (c >> 12 & 0x3F);
+		*p++ = 0x80 | (c >> 6 & 0x3F);
+		*p++ = 0x80 | (c & 0x3F);
+	}
+	return p;
+}
+
+static const char pathChars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.";
+static const char shellChars[] = " \t\n'\"`$\\!*?[]{}()<>|&;#~=%^ abcdefgh";
+
+//  Each generator fills one string of roughly the given length at p and returns its end
+typedef unsigned char * (* corpusGenerator)(unsigned char * p, size_t length);
+
+static unsigned char * generatePaths(unsigned char * p, size_t length)
+{
+	unsigned char * end = p + length;
+	while(p < end) {
+		*p++ = '/';
+		for(unsigned n = 2 + randomBelow(10); n; n--)
+			*p++ = pathChars[randomBelow(sizeof(pathChars) - 1)];
+	}
+	return p;
+}
+
+static unsigned char * generateShell(unsigned char * p, size_t length)
+{
+	for(unsigned char * end = p + length; p < end; p++)
+		*p = shellChars[randomBelow(sizeof(shellChars) - 1)];
+	return p;
+}
+
+static unsigned char * generateBinary(unsigned char * p, size_t length)
+{
+	for(unsigned char * end = p + length; p < end; p++)
+		//  Nulls would just shorten the strings
+		*p = 1 + randomBelow(255);
+	return p;
+}
+
+//  Mostly text, with stray continuation bytes, truncated and overlong sequences, surrogates,
+// and bytes that never appear in UTF-8
+static unsigned char * generateInvalidUtf8(unsigned char * p, size_t length)
+{
+	static const unsigned char invalid[][4] = {
+		{1, 0x80}, {1, 0xBF}, {2, 0xC3, 'x'}, {2, 0xE2, 0x82}, {2, 0xC0, 0x80}, {3, 0xED, 0xA0, 0x80},
+		{1, 0xF5}, {1, 0xFF}
+	};
+	unsigned char * end = p + length;
+	while(p < end) {
+		unsigned r = randomBelow(16);
+		if(! r) {
+			const unsigned char * seq = invalid[randomBelow(sizeof(invalid) / sizeof(*invalid))];
+			memcpy(p, seq + 1, *seq);
+			p += *seq;
+		}
+		else if(1 == r)
+			p = putUtf8(p, 0xA0 + randomBelow(0x60));
+		else
+			*p++ = pathChars[randomBelow(sizeof(pathChars) - 1)];
+	}
+	return p;
+}
+
+static unsigned char * generateCjk(unsigned char * p, size_t length)
+{
+	unsigned char * end = p + length;
+	while(p < end)
+		p = randomBelow(8) ? putUtf8(p, 0x4E00 + randomBelow(0x5200)) :
+			putUtf8(p, pathChars[randomBelow(sizeof(pathChars) - 1)]);
+	return p;
+}
+
+//  Astral pictographs joined by zero width joiners and followed by variation selectors, which
+// are invisible on their own
+static unsigned char * generateEmoji(unsigned char * p, size_t length)
+{
+	unsigned char * end = p + length;
+	while(p < end) {
+		p = putUtf8(p, 0x1F300 + randomBelow(0x350));
+		unsigned r = randomBelow(8);
+		if(! r)
+			p = putUtf8(p, 0x200D);
+		else if(1 == r)
+			p = putUtf8(p, 0xFE0F);
+		else if(2 == r)
+			*p++ = ' ';
+	}
+	return p;
+}
+
+static unsigned char * generateCombining(unsigned char * p, size_t length)
+{
+	unsigned char * end = p + length;
+	while(p < end) {
+		*p++ = 'a' + randomBelow(26);
+		for(unsigned n = randomBelow(3); n; n--)
+			p = putUtf8(p, 0x300 + randomBelow(0x70));
+	}
+	return p;
+}
+
+//  Short strings of the pieces that the engines treat specially:  a tilde at the start, octal
+// and hex escapes followed by digits, quotes and backslashes at quoting changes, invisible,
+// blank, and non-printable astral code points, invalid or truncated UTF-8, and what looks like
+// $'' quoting with a backslash that the end of the string can follow
+static unsigned char * generateTricky(unsigned char * p, size_t length)
+{
+	static const char * const pieces[] = {
+		"~", "~/", "\x01", "\x1b", "\x7f", "\t", "\n", "0", "7", "8", "9", "a", "f", "F", "g", "'",
+		"\\", " ", "$", "!", "\xc3\xa9", "\xcc\x81", "\xc2\xa0", "\xe2\x80\x8b", "\xef\xbf\xbf",
+		"\xf0\x9f\x98\x80", "\xf3\xa0\x80\x81", "\xed\xa0\x80", "\xc0\x80", "\x80", "\xff",
+		"\xe2\x82", "\xf0\x9f", "$'a\\"
+	};
+	for(unsigned char * end = p + length; p < end;) {
+		const char * piece = pieces[randomBelow(sizeof(pieces) / sizeof(*pieces))];
+		size_t size = strlen(piece);
+		memcpy(p, piece, size);
+		p += size;
+	}
+	return p;
+}
+
+static const struct corpus {
+	const char * name;
+	corpusGenerator generate;
+	//  The range of string lengths
+	unsigned minimum;
+	unsigned maximum;
+} corpora[] = {
+	{"paths", generatePaths, 16, 200},
+	{"shell", generateShell, 4, 80},
+	{"binary", generateBinary, 16, 4096},
+	{"invalid-utf8", generateInvalidUtf8, 16, 200},
+	{"cjk", generateCjk, 8, 120},
+	{"emoji", generateEmoji, 8, 120},
+	{"combining", generateCombining, 8, 120},
+	{"tricky", generateTricky, 0, 24}
+};
+#define CORPUS_COUNT (sizeof(corpora) / sizeof(*corpora))
+
+static const struct benchOption {
+	const char * name;
+	unsigned flags;
+} options[] = {
+	{"", 0},
+	{"-u", PRINTFQ_UNICODE_ESCAPES},
+	{"-i", PRINTFQ_ESCAPE_INVISIBLE},
+	{"-e", PRINTFQ_ESCAPE_MORE},
+	{"-eu", PRINTFQ_ESCAPE_MORE | PRINTFQ_UNICODE_ESCAPES},
+	{"-m", PRINTFQ_MINIMAL},
+	{"-z", PRINTFQ_NULL_TERMINATED_OUTPUT},
+	{"-o", PRINTFQ_OPTIMIZE_OUTPUT_LENGTH},
+	{"-ou", PRINTFQ_OPTIMIZE_OUTPUT_LENGTH | PRINTFQ_UNICODE_ESCAPES}
+};
+#define OPTION_COUNT (sizeof(options) / sizeof(*options))
+
+//  The locales tried for each character set.  The first one that setlocale() accepts is used.
+static const char * const locales[][6] = {
+	{"C"},
+	{"C.UTF-8", "C.utf8", "en_US.UTF-8", "en_US.utf8"},
+	{"ja_JP.EUC-JP", "ja_JP.eucjp", "zh_TW.BIG5", "zh_TW.big5"},
+	{"en_US.ISO-8859-1", "en_US.iso88591", "de_DE.ISO-8859-1", "de_DE.iso88591"}
+};
+static const char * const charsetNames[] = {"ascii", "utf-8", "locale", "single"};
+
+//  Set the LC_CTYPE locale to the first available one for the character set, or to benchLocale
+// for those other than ASCII and UTF-8 when it is set, and return its name, or NULL if there is
+// none.
+static const char * findLocale(unsigned charset, const char * benchLocale)
+{
+	const char * const * candidate = locales[charset];
+	const char * const only[] = {benchLocale, NULL};
+	printfq_opts opts;
+	if(PRINTFQ_CHARSET_LOCALE <= charset && benchLocale && *benchLocale)
+		candidate = only;
+	for(; *candidate; candidate++)
+		if(setlocale(LC_CTYPE, *candidate) && ! printfq_opts_init(&opts, 0) &&
+			charset == opts.charset)
+			return *candidate;
+	return NULL;
+}
+
+//  NUL separated strings, as printfq reads from stdin
+static unsigned char * generateCorpus(const struct corpus * c, size_t size, size_t * length)
+{
+	//  Leave room for the last string and its multibyte characters to overrun
+	unsigned char * buf = malloc(size + c->maximum + 16);
+	if(! buf)
+		return NULL;
+	unsigned char * p = buf;
+	randomState = 0x9E3779B97F4A7C15ULL + size;
+	for(const char * n = c->name; *n; n++)
+		randomState = (randomState ^ (unsigned char)*n) * 0x100000001B3ULL;
+	while(p < buf + size) {
+		p = c->generate(p, c->minimum + randomBelow(c->maximum - c->minimum + 1));
+		*p++ = 0;
+	}
+	*length = p - buf;
+	return buf;
+}
+
+struct countingOutput {
+	printfq_output out;
+	size_t length;
+	char buf[OUTPUT_BUFFER_SIZE];
+};
+
+static int countingFlush(printfq_output * out)
+{
+	((struct countingOutput *)out)->length += out->pos - out->buf;
+	out->pos = out->buf;
+	return 0;
+}
+
+static int countingWrite(printfq_output * out, const void * ptr, size_t size)
+{
+	((struct countingOutput *)out)->length += (out->pos - out->buf) + size;
+	out->pos = out->buf;
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//  Escape the corpus repeatedly for at least the given number of seconds, and return the
+// fastest time for a single pass.  When the input cannot be decoded, length is reduced to what
+// was escaped before the error and decodeError is set.  Returns a negative value with errno set
+// on any other error.
+static double measure(streamEscaper escape, const printfq_opts * opts,
+	const unsigned char * corpus, size_t * length, double seconds, size_t * outputLength,
+	int * decodeError)
+{
+	static struct countingOutput output;
+	double best = -1, start = now(), elapsed;
+	*decodeError = 0;
+	do {
+		printfq_input in = {.pos = corpus, .end = corpus + *length};
+		output.out = (printfq_output){
+			.buf = output.buf,
+			.pos = output.buf,
+			.end = output.buf + sizeof(output.buf),
+			.flush = countingFlush,
+			.write = countingWrite
+		};
+		output.length = 0;
+		double t = now();
+		if(escape(opts, &in, &output.out)) {
+			if(EILSEQ != errno)
+				return -1;
+			*decodeError = 1;
+		}
+		t = now() - t;
+		if(0 > best || t < best)
+			best = t;
+		elapsed = now() - start;
+		*length = in.pos - corpus;
+	} while(elapsed < seconds);
+	*outputLength = output.length;
+	return best;
+}
+
+//  Run the program with a short argument and its output discarded, repeatedly for at least the
+// given number of seconds, and return the average time for a run and set fastest to the fastest.
+// Returns -1 with errno set if the program cannot be started, or -2 if it fails.
+static double measureStartup(const char * program, double seconds, double * fastest)
+{
+	char * const args[] = {(char *)program, "--", "a b\xC3\xA9", NULL};
+	posix_spawn_file_actions_t actions;
+	double start = now(), elapsed, result = -1;
+	unsigned runs = 0;
+	if((errno = posix_spawn_file_actions_init(&actions)))
+		return -1;
+	if(! (errno = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY,
+		0)))
+		do {
+			pid_t pid;
+			int status;
+			double t = now();
+			if((errno = posix_spawn(&pid, program, &actions, NULL, args, environ)))
+				goto done;
+			while(0 > waitpid(pid, &status, 0))
+				if(EINTR != errno)
+					goto done;
+			t = now() - t;
+			if(! WIFEXITED(status) || WEXITSTATUS(status)) {
+				result = -2;
+				goto done;
+			}
+			if(! runs++ || t < *fastest)
+				*fastest = t;
+			elapsed = now() - start;
+		} while(elapsed < seconds || MINIMUM_STARTUP_RUNS > runs);
+	if(runs)
+		result = elapsed / runs;
+	done:
+	posix_spawn_file_actions_destroy(&actions);
+	return result;
+}
+
+//  -x.  Each program is started with LC_ALL set to the locale of each character set in turn.
+static int benchStartup(const char * const * programs, size_t count, double seconds,
+	const char * benchLocale)
+{
+	printf("%-32s %-7s %10s %10s\n", "program", "charset", "us/run", "fastest");
+	for(size_t p = 0; p < count; p++)
+		for(unsigned charset = PRINTFQ_CHARSET_ASCII; charset <= PRINTFQ_CHARSET_SINGLE_BYTE; charset++) {
+			const char * locale = findLocale(charset, benchLocale);
+			double fastest = 0;
+			if(! locale)
+				continue;
+			setenv("LC_ALL", locale, 1);
+			double t = measureStartup(programs[p], seconds, &fastest);
+			printf("%-32s %-7s ", programs[p], charsetNames[charset]);
+			if(-1 == t) {
+				printf("%s\n", strerror(errno));
+				return EX_OSERR;
+			}
+			if(0 > t)
+				printf("failed\n");
+			else
+				printf("%10.1f %10.1f\n", t * 1e6, fastest * 1e6);
+			fflush(stdout);
+		}
+	return 0;
+}
+
+//  How the program is given the corpus for -p
+enum driverInput {
+	DRIVER_PIPE,      // on stdin from a pipe
+	DRIVER_FILE,      // on stdin from a file, which it maps
+	DRIVER_OPTION,    // from a file with --input
+	DRIVER_SHARDS,    // on stdin from a file, in DRIVER_SHARD_COUNT runs with --shard
+	DRIVER_ARGUMENTS  // as arguments, for the strings in the first ARGUMENT_BYTES of the corpus
+};
+#define DRIVER_SHARD_COUNT 3
+//  Including the argument pointers
+#define ARGUMENT_BYTES (1024 * 1024)
+
+static const struct driverRun {
+	const char * name;
+	const char * option;
+	enum driverInput input;
+	unsigned toPipe;
+} driverRuns[] = {
+	{"mmap", NULL, DRIVER_FILE, 0},
+	{"splice", NULL, DRIVER_FILE, 1},
+	{"-j4", "-j4", DRIVER_FILE, 0},
+	{"-j4-pipe", "-j4", DRIVER_PIPE, 0},
+	{"-j4-splice", "-j4", DRIVER_FILE, 1},
+	{"--input", NULL, DRIVER_OPTION, 0},
+	{"--shard", NULL, DRIVER_SHARDS, 0},
+	{"argv", NULL, DRIVER_ARGUMENTS, 0},
+	{"argv-j4", "-j4", DRIVER_ARGUMENTS, 0}
+};
+#define DRIVER_RUN_COUNT (sizeof(driverRuns) / sizeof(*driverRuns))
+
+//  Add everything that can be read from fd to output.  Returns 0 or an errno value.
+static int collectFrom(int fd, struct collectingOutput * output)
+{
+	ssize_t rc;
+	while(0 != (rc = read(fd, output->buf, sizeof(output->buf))))
+		if(0 > rc ? EINTR != errno : collect(output, output->buf, rc))
+			return 0 > rc ? errno : ENOMEM;
+	return 0;
+}
+
+//  Start the program with args, stdin from inFd, stdout to outFd, and stderr discarded.  Returns
+// 0 or an errno value.
+static int spawnProgram(char * const * args, int inFd, int outFd, pid_t * pid)
+{
+	posix_spawn_file_actions_t actions;
+	int error = posix_spawn_file_actions_init(&actions);
+	if(error)
+		return error;
+	if(! (error = posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO)) &&
+		! (error = posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO)) &&
+		! (error = posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY,
+		0)))
+		error = posix_spawn(pid, *args, &actions, NULL, args, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	return error;
+}
+
+//  Run the program with args and its stderr discarded, with stdin from inFd, or when inFd is -1,
+// from a pipe that the length bytes at input are written to, and add its stdout to output, from a
+// pipe when toPipe and otherwise from a file.  The input and the output must not both be pipes.
+// Returns the exit status, or 128 plus the signal that ended the program, or -1 with errno set.
+static int runProgram(char * const * args, int inFd, const unsigned char * input, size_t length,
+	unsigned toPipe, struct collectingOutput * output)
+{
+	int in[2] = {-1, -1}, out[2] = {-1, -1}, status = 0, error;
+	pid_t pid;
+	if((0 > inFd && pipe2(in, O_CLOEXEC)) || (toPipe ? pipe2(out, O_CLOEXEC) :
+		0 > (out[1] = memfd_create("printfq-bench-output", MFD_CLOEXEC))))
+		error = errno;
+	else
+		error = spawnProgram(args, 0 > inFd ? in[0] : inFd, out[1], &pid);
+	if(! error) {
+		if(0 > inFd) {
+			close(in[0]);
+			in[0] = -1;
+			while(length && ! error) {
+				ssize_t rc = write(in[1], input, length);
+				if(0 <= rc)
+					input += rc, length -= rc;
+				//  The program may exit without reading all of its input
+				else if(EPIPE == errno)
+					break;
+				else if(EINTR != errno)
+					error = errno;
+			}
+			close(in[1]);
+			in[1] = -1;
+		}
+		if(toPipe) {
+			close(out[1]);
+			out[1] = -1;
+			if(! error)
+				error = collectFrom(out[0], output);
+			close(out[0]);
+			out[0] = -1;
+		}
+		while(0 > waitpid(pid, &status, 0))
+			if(EINTR != errno) {
+				error = errno;
+				break;
+			}
+		if(! toPipe && ! error)
+			error = lseek(out[1], 0, SEEK_SET) ? errno : collectFrom(out[1], output);
+	}
+	for(unsigned idx = 0; idx < 2; idx++) {
+		if(0 <= in[idx])
+			close(in[idx]);
+		if(0 <= out[idx])
+			close(out[idx]);
+	}
+	if(error) {
+		errno = error;
+		return -1;
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+//  Set LC_CTYPE in the environment, without LC_ALL, to the first available locale for the
+// character set, as findLocale() does, and return it, or NULL if there is none
+static const char * useLocale(unsigned charset, const char * benchLocale)
+{
+	const char * locale = findLocale(charset, benchLocale);
+	if(locale) {
+		unsetenv("LC_ALL");
+		setenv("LC_CTYPE", locale, 1);
+	}
+	return locale;
+}
+
+//  -p, with -z and --flush-idle, and option unless it is NULL.  The output for a string from
+// null terminated input, including its null terminator, must arrive while the program waits
+// for the next string.  Returns 1 when it does within FLUSH_WAIT seconds, 0 when it does not, or
+// -1 with errno set on error.
+#define FLUSH_WAIT 2.0
+static int checkFlushIdle(const char * program, const char * option)
+{
+	char * const args[] = {(char *)program, "-z", "--flush-idle", (char *)option, NULL};
+	int in[2] = {-1, -1}, out[2] = {-1, -1}, status, error, rc = 0;
+	char buf[4];
+	size_t got = 0;
+	pid_t pid;
+	if(pipe2(in, O_CLOEXEC) || pipe2(out, O_CLOEXEC))
+		error = errno;
+	else
+		error = spawnProgram(args, in[0], out[1], &pid);
+	if(! error) {
+		close(in[0]);
+		close(out[1]);
+		in[0] = out[1] = -1;
+		//  The string, and its null terminator
+		if(sizeof("a") != write(in[1], "a", sizeof("a")))
+			error = errno;
+		struct pollfd pfd = {out[0], POLLIN, 0};
+		for(double deadline = now() + FLUSH_WAIT, t; ! error && got < sizeof("a") &&
+			(t = deadline - now()) > 0;) {
+			int ready = poll(&pfd, 1, t * 1000 + 1);
+			ssize_t size = 0 < ready ? read(out[0], buf + got, sizeof(buf) - got) : 0;
+			if(0 > ready || 0 > size)
+				error = EINTR == errno ? 0 : errno;
+			else if(ready && ! size)
+				break;
+			else
+				got += size;
+		}
+		rc = sizeof("a") == got && ! memcmp(buf, "a", sizeof("a"));
+		close(in[1]);
+		in[1] = -1;
+		while(0 > waitpid(pid, &status, 0))
+			if(EINTR != errno) {
+				error = errno;
+				break;
+			}
+	}
+	for(unsigned idx = 0; idx < 2; idx++) {
+		if(0 <= in[idx])
+			close(in[idx]);
+		if(0 <= out[idx])
+			close(out[idx]);
+	}
+	if(error) {
+		errno = error;
+		return -1;
+	}
+	return rc;
+}
+
+//  -p.  The program's output for the corpus on stdin from a pipe is compared to its output for
+// each of driverRuns, with the locale of each character set in LC_CTYPE and with each of the
+// options.  The runs that read arguments are compared to its output for those strings on stdin
+// from a pipe.  The shards and arguments are not compared when the input cannot be decoded,
+// since the output of each ends at its own decoding error.  Returns the number of mismatches, or
+// -1 with errno set on error.
+static int checkProgram(const char * program, const char * name, const unsigned char * corpus,
+	size_t length, const char * benchLocale)
+{
+	static struct collectingOutput reference, argumentReference, output;
+	char inputOption[32], shardOption[32];
+	int mismatches = 0, fd = memfd_create("printfq-bench-input", 0), error;
+	size_t limit = sysconf(_SC_ARG_MAX) / 2, argumentLength = 0, argumentCount = 0;
+	ssize_t written = 0;
+	char ** args = NULL;
+	if(0 > fd)
+		return -1;
+	for(size_t done = 0; done < length && 0 <= written; done += written)
+		written = write(fd, corpus + done, length - done);
+	//  The strings that fit in the arguments
+	if(limit > ARGUMENT_BYTES)
+		limit = ARGUMENT_BYTES;
+	for(size_t idx = 0, size; idx < length; idx += size) {
+		size = strlen((const char *)corpus + idx) + 1;
+		if(argumentLength + size + (argumentCount + 1) * sizeof(char *) > limit)
+			break;
+		argumentLength += size;
+		argumentCount++;
+	}
+	if(0 > written || ! (args = malloc((argumentCount + 8) * sizeof(*args))))
+		goto failed;
+	snprintf(inputOption, sizeof(inputOption), "--input=/dev/fd/%d", fd);
+	for(unsigned charset = PRINTFQ_CHARSET_ASCII; charset <= PRINTFQ_CHARSET_SINGLE_BYTE; charset++) {
+		if(! useLocale(charset, benchLocale))
+			continue;
+		for(size_t o = 0; o < OPTION_COUNT; o++) {
+			size_t base = 0;
+			args[base++] = (char *)program;
+			if(*options[o].name)
+				args[base++] = (char *)options[o].name;
+			args[base] = NULL;
+			reference.length = argumentReference.length = 0;
+			int status = runProgram(args, -1, corpus, length, 0, &reference);
+			int argumentStatus = runProgram(args, -1, corpus, argumentLength, 0, &argumentReference);
+			if(0 > status || 0 > argumentStatus)
+				goto failed;
+			printf("%-14s %-7s %-8s ", name, charsetNames[charset], options[o].name);
+			unsigned matched = 1;
+			for(size_t r = 0; r < DRIVER_RUN_COUNT; r++) {
+				const struct driverRun * run = driverRuns + r;
+				const struct collectingOutput * expected = &reference;
+				int expectedStatus = status, runStatus = 0;
+				size_t n = base;
+				if(run->option)
+					args[n++] = (char *)run->option;
+				if(DRIVER_OPTION == run->input)
+					args[n++] = inputOption;
+				else if(DRIVER_SHARDS == run->input)
+					args[n++] = shardOption;
+				else if(DRIVER_ARGUMENTS == run->input) {
+					args[n++] = "--";
+					for(size_t idx = 0, a = 0; a < argumentCount; a++) {
+						args[n++] = (char *)corpus + idx;
+						idx += strlen(args[n - 1]) + 1;
+					}
+					expected = &argumentReference;
+					expectedStatus = argumentStatus;
+				}
+				args[n] = NULL;
+				if((DRIVER_SHARDS == run->input || DRIVER_ARGUMENTS == run->input) && expectedStatus)
+					continue;
+				//  The output of the shards is concatenated
+				const unsigned shards = DRIVER_SHARDS == run->input ? DRIVER_SHARD_COUNT : 1;
+				output.length = 0;
+				for(unsigned shard = 1; shard <= shards && ! runStatus; shard++) {
+					snprintf(shardOption, sizeof(shardOption), "--shard=%u/%u", shard, shards);
+					if(lseek(fd, 0, SEEK_SET) || 0 > (runStatus = runProgram(args,
+						DRIVER_PIPE == run->input || DRIVER_OPTION == run->input ? -1 : fd,
+						corpus, DRIVER_PIPE == run->input ? length : 0, run->toPipe, &output)))
+						goto failed;
+				}
+				if(runStatus != expectedStatus || output.length != expected->length ||
+					(output.length && memcmp(output.data, expected->data, output.length))) {
+					printf(matched ? "MISMATCH: %s" : " %s", run->name);
+					matched = 0;
+					mismatches++;
+				}
+			}
+			if(matched)
+				printf("ok");
+			if(status)
+				printf("  (invalid)");
+			putchar('\n');
+			fflush(stdout);
+		}
+	}
+	free(args);
+	close(fd);
+	return mismatches;
+	failed:
+	error = errno;
+	free(args);
+	close(fd);
+	errno = error;
+	return -1;
+}
+
+static void usage(const char * arg0)
+{
+	printf("Usage: %s [-v] [-s SIZE] [-t SECONDS] [CORPUS]...\n"
+		"       %s [-s SIZE] -p PROGRAM [CORPUS]...\n"
+		"       %s [-t SECONDS] -x PROGRAM...\n"
+		"Measure the throughput of the printfq escaping engines on generated corpora.  For each\n"
+		"corpus, character set, and combination of options, the throughput, time per input\n"
+		"byte, and ratio of output to input length are reported.  The fastest of repeated\n"
+		"passes over each corpus is used.\n"
+		"  -p PROGRAM  Instead, check that PROGRAM, a printfq build, gives the same output for\n"
+		"              each corpus on stdin from a pipe as from a file, to a pipe, with -j4,\n"
+		"              --input, and --shard, and for its strings as arguments, and that with\n"
+		"              -z and --flush-idle, each string's output and its null terminator are\n"
+		"              written while it waits for the next string.  The exit status is 1 when\n"
+		"              any output differs\n"
+		"  -s SIZE     Generate corpora of about SIZE bytes, with an optional K or M suffix.\n"
+		"              The default is 4M\n"
+		"  -t SECONDS  Repeat each measurement for at least SECONDS.  The default is 0.2\n"
+		"  -v          Also escape each corpus with the reference engine, printfq version 3,\n"
+		"              and verify that the output is the same, and the same again when the\n"
+		"              input and output are split into random pieces, and for ASCII and\n"
+		"              UTF-8, that decoding it gives back the corpus.  The throughput of the\n"
+		"              reference engine is reported as well.  The exit status is 1 when any\n"
+		"              output differs\n"
+
+		"  -x PROGRAM  Instead, measure the average and fastest time for PROGRAM, a printfq\n"
+		"              build, to escape a short argument, including starting it.  This may\n"
+		"              be given more than once, to compare builds\n"
+		"Corpora:", arg0, arg0, arg0);
+	for(size_t idx = 0; idx < CORPUS_COUNT; idx++)
+		printf(" %s", corpora[idx].name);
+	printf("\nThe character sets are those of the C locale, the first available of C.UTF-8 and "
+		"en_US.UTF-8,\nand the first available of several multibyte and of several single byte locales, "
+		"or the\nlocale in PRINTFQ_BENCH_LOCALE for whichever of those it is.\n");
+}
+
+int main(int argc, char ** argv)
+{
+	size_t size = DEFAULT_CORPUS_SIZE;
+	double seconds = DEFAULT_SECONDS;
+	int opt, verifying = 0, mismatches = 0;
+	const char * programs[argc], * checkedProgram = NULL;
+	size_t programCount = 0;
+	while(-1 != (opt = getopt(argc, argv, "hp:s:t:vx:"))) {
+		char * end;
+		switch(opt) {
+			case 's':
+				size = strtoul(optarg, &end, 10);
+				if('K' == *end || 'k' == *end)
+					size <<= 10, end++;
+				else if('M' == *end || 'm' == *end)
+					size <<= 20, end++;
+				if(*end || ! size) {
+					fprintf(stderr, "Invalid size: %s\n", optarg);
+					return EX_USAGE;
+				}
+				break;
+			case 't':
+				seconds = strtod(optarg, &end);
+				if(*end || 0 > seconds) {
+					fprintf(stderr, "Invalid number of seconds: %s\n", optarg);
+					return EX_USAGE;
+				}
+				break;
+			case 'p':
+				checkedProgram = optarg;
+				break;
+			case 'v':
+				verifying = 1;
+				break;
+			case 'x':
+				programs[programCount++] = optarg;
+				break;
+			case 'h':
+				usage(*argv);
+				return 0;
+			default:
+				return EX_USAGE;
+		}
+	}
+	const char * benchLocale = getenv("PRINTFQ_BENCH_LOCALE");
+	if(programCount)
+		return benchStartup(programs, programCount, seconds, benchLocale);
+	unsigned selected[CORPUS_COUNT] = {0};
+	for(int idx = optind; idx < argc; idx++) {
+		size_t c = 0;
+		while(c < CORPUS_COUNT && strcmp(argv[idx], corpora[c].name))
+			c++;
+		if(CORPUS_COUNT == c) {
+			fprintf(stderr, "Unknown corpus: %s\n", argv[idx]);
+			return EX_USAGE;
+		}
+		selected[c] = 1;
+	}
+	if(checkedProgram) {
+		//  The program may exit without reading all of its input when it cannot be decoded
+		signal(SIGPIPE, SIG_IGN);
+		printf("%-14s %-7s %-8s %s\n", "corpus", "charset", "options", "result");
+		//  Each engine, and the optimizer
+		static const char * const flushOptions[] = {NULL, "-m", "-o"};
+		for(unsigned charset = PRINTFQ_CHARSET_ASCII; charset <= PRINTFQ_CHARSET_SINGLE_BYTE; charset++)
+			for(size_t o = 0; useLocale(charset, benchLocale) && o < sizeof(flushOptions) /
+				sizeof(*flushOptions); o++) {
+				int rc = checkFlushIdle(checkedProgram, flushOptions[o]);
+				if(0 > rc) {
+					perror(checkedProgram);
+					return EX_OSERR;
+				}
+				printf("%-14s %-7s %-8s %s\n", "--flush-idle", charsetNames[charset],
+					flushOptions[o] ? flushOptions[o] : "", rc ? "ok" : "MISMATCH: late terminator");
+				mismatches += ! rc;
+			}
+	}
+	else
+		printf("%-14s %-7s %-8s %10s %9s %9s%s\n", "corpus", "charset", "options", "MB/s", "ns/byte",
+			"expansion", verifying ? "   ref MB/s  result" : "");
+	int malformed;
+	if(verifying && (malformed = verifyMalformed())) {
+		printf("Decoding accepted %d malformed inputs\n", malformed);
+		mismatches += malformed;
+	}
+	for(size_t c = 0; c < CORPUS_COUNT; c++) {
+		if(optind < argc && ! selected[c])
+			continue;
+		size_t length;
+		unsigned char * corpus = generateCorpus(corpora + c, size, &length);
+		if(! corpus) {
+			perror("Unable to allocate the corpus");
+			return EX_OSERR;
+		}
+		if(checkedProgram) {
+			int n = checkProgram(checkedProgram, corpora[c].name, corpus, length, benchLocale);
+			if(0 > n) {
+				perror(checkedProgram);
+				return EX_OSERR;
+			}
+			mismatches += n;
+			free(corpus);
+			continue;
+		}
+		for(unsigned charset = PRINTFQ_CHARSET_ASCII; charset <= PRINTFQ_CHARSET_SINGLE_BYTE; charset++) {
+			printfq_opts opts;
+			if(! findLocale(charset, benchLocale))
+				continue;
+			printfq_opts_init(&opts, 0);
+			for(size_t o = 0; o < OPTION_COUNT; o++) {
+				size_t outputLength, escaped = length;
+				int decodeError;
+				opts.flags = options[o].flags;
+				double t = measure(printfq_escape_stream, &opts, corpus, &escaped, seconds,
+					&outputLength, &decodeError);
+				printf("%-14s %-7s %-8s ", corpora[c].name, charsetNames[charset], options[o].name);
+				if(0 > t) {
+					printf("%s\n", strerror(errno));
+					continue;
+				}
+				if(escaped < length / 100)
+					printf("%10s %9s %9s", "-", "-", "-");
+				else
+					printf("%10.1f %9.3f %9.3f", escaped / t / 1e6, t * 1e9 / escaped,
+						(double)outputLength / escaped);
+				if(verifying) {
+					size_t referenceEscaped = length, offset = 0;
+					int referenceDecodeError, rc = 0;
+					//  The reference engine does not have PRINTFQ_OPTIMIZE_OUTPUT_LENGTH
+					double r = measure(printfq_reference_escape_stream, &opts, corpus, &referenceEscaped,
+						seconds, &outputLength, &referenceDecodeError);
+					if(0 > r && ENOTSUP != errno)
+						rc = -1;
+					for(unsigned round = 0; ! rc && round < VERIFY_ROUNDS; round++)
+						rc = verify(&opts, corpus, length, &offset);
+					if(0 > rc) {
+						printf("  %s\n", strerror(errno));
+						continue;
+					}
+					if(0 > r || referenceEscaped < length / 100)
+						printf(" %10s", "-");
+					else
+						printf(" %10.1f", referenceEscaped / r / 1e6);
+					if(rc) {
+						mismatches++;
+						printf(1 == rc ? "  MISMATCH at output byte %zu" :
+							2 == rc ? "  MISMATCH at decoded byte %zu" :
+							"  MISMATCH at byte %zu in pieces", offset);
+					}
+					else
+						printf("  ok");
+				}
+				if(decodeError)
+					printf(escaped < length / 100 ? "  (invalid)" : "  (invalid after %.0f%%)",
+						100.0 * escaped / length);
+				putchar('\n');
+				fflush(stdout);
+			}
+		}
+		free(corpus);
+	}
+	return ! ! mismatches;
+}
+#endif
@@ -0,0 +1,163 @@
+//  libprintfq-reference
+//  The reference engine that the library is verified against:  printfq version 3, from before the
+// escaping engines were split into libprintfq, kept unchanged in reference/printfq.c.  It shares
+// no code with the library, so a bug in either one shows up as a difference between them.  Its
+// main() is compiled as printfq_reference_main(), with its stdin and stdout replaced by files in
+// memory, and printfq_reference_escape_stream() runs it as the command would have been run on the
+// input, with the option letters for the flags.  It has neither -o nor -f, for which it fails with
+// ENOTSUP, and it decides the character set from the locale, as the command did.
+
+#define _GNU_SOURCE
+#include "printfq.h"
+#include <errno.h>
+#include <getopt.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <sys/mman.h>
+
+int printfq_reference_escape_stream(const printfq_opts * opts, printfq_input * in,
+	printfq_output * out);
+int printfq_reference_main(int argc, char ** argv);
+
+static FILE * referenceIn;
+static FILE * referenceOut;
+
+#undef stdin
+#undef stdout
+#define stdin referenceIn
+#define stdout referenceOut
+#define printf(...) fprintf(referenceOut, __VA_ARGS__)
+#define wprintf(...) fwprintf(referenceOut, __VA_ARGS__)
+#define main printfq_reference_main
+#define versionString referenceVersionString
+#include "reference/printfq.c"
+#undef main
+#undef wprintf
+#undef printf
+#undef stdout
+#undef stdin
+
+//  Copy all of the input to fd.  Returns 0, or -1 with errno set.
+static int writeInput(printfq_input * in, int fd)
+{
+	for(;;) {
+		while(in->pos != in->end) {
+			ssize_t rc = write(fd, in->pos, in->end - in->pos);
+			if(0 > rc)
+				return -1;
+			in->pos += rc;
+		}
+		ssize_t rc = in->refill ? in->refill(in) : 0;
+		if(0 >= rc) {
+			if(rc)
+				in->error = errno;
+			return rc;
+		}
+	}
+}
+
+//  Copy the output in fd to out, and flush it.  Returns 0, or -1 with errno set.
+static int readOutput(int fd, printfq_output * out)
+{
+	ssize_t rc;
+	if(lseek(fd, 0, SEEK_SET))
+		return -1;
+	do {
+		if(out->pos == out->end && out->flush(out))
+			return out->error = errno, -1;
+		if(0 > (rc = read(fd, out->pos, out->end - out->pos)))
+			return -1;
+		out->pos += rc;
+	} while(rc);
+	if(out->pos != out->buf && out->flush(out))
+		return out->error = errno, -1;
+	return 0;
+}
+
+int printfq_reference_escape_stream(const printfq_opts * opts, printfq_input * in,
+	printfq_output * out)
+{
+	static const struct {
+		unsigned flag;
+		char * arg;
+	} flagArgs[] = {
+		{PRINTFQ_ESCAPE_MORE, "-e"},
+		{PRINTFQ_ESCAPE_INVISIBLE, "-i"},
+		{PRINTFQ_MINIMAL, "-m"},
+		{PRINTFQ_IGNORE_NULL_INPUT, "-n"},
+		{PRINTFQ_UNICODE_ESCAPES, "-u"},
+		{PRINTFQ_NULL_TERMINATED_OUTPUT, "-z"}
+	};
+	char * argv[sizeof(flagArgs) / sizeof(*flagArgs) + 2] = {"printfq"};
+	int argc = 1;
+	if(opts->flags & (PRINTFQ_FLUSH_ARGUMENTS | PRINTFQ_OPTIMIZE_OUTPUT_LENGTH)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	for(size_t idx = 0; idx < sizeof(flagArgs) / sizeof(*flagArgs); idx++)
+		if(opts->flags & flagArgs[idx].flag)
+			argv[argc++] = flagArgs[idx].arg;
+	//  The command takes its locale from the environment, so it is given the current LC_CTYPE
+	// locale there, or C for ASCII, without LC_ALL, which would also need the other categories of
+	// that locale.  Everything is put back afterwards, along with getopt().
+	const int previousOptind = optind;
+	const char * previousAll = getenv("LC_ALL");
+	const char * previousCtype = getenv("LC_CTYPE");
+	char * previous = strdup(setlocale(LC_ALL, NULL));
+	char * all = previousAll ? strdup(previousAll) : NULL;
+	char * ctype = previousCtype ? strdup(previousCtype) : NULL;
+	const char * locale = PRINTFQ_CHARSET_ASCII == opts->charset ? "C" : setlocale(LC_CTYPE, NULL);
+	int inFd = memfd_create("printfq-reference-input", 0);
+	int outFd = memfd_create("printfq-reference-output", 0);
+	int rc = -1, error = 0;
+	if(! previous || (previousAll && ! all) || (previousCtype && ! ctype) || 0 > inFd || 0 > outFd ||
+		unsetenv("LC_ALL") || setenv("LC_CTYPE", locale, 1))
+		error = errno;
+	else if(writeInput(in, inFd) || lseek(inFd, 0, SEEK_SET))
+		error = in->error ? in->error : errno;
+	else if(! (referenceIn = fdopen(inFd, "r")) || (inFd = -1, ! (referenceOut = fdopen(outFd, "w+"))))
+		error = errno;
+	else {
+		outFd = -1;
+		optind = 0;
+		//  The command ends its output at a decoding error, as though the input had ended, and
+		// exits with EILSEQ
+		int status = printfq_reference_main(argc, argv);
+		if(fflush(referenceOut) || (status && EILSEQ != status))
+			error = EIO;
+		else if(status || ferror(referenceIn))
+			error = EILSEQ;
+		if(readOutput(fileno(referenceOut), out) && ! error)
+			error = errno;
+		rc = error ? -1 : 0;
+	}
+	if(referenceIn)
+		fclose(referenceIn);
+	if(referenceOut)
+		fclose(referenceOut);
+	referenceIn = referenceOut = NULL;
+	if(0 <= inFd)
+		close(inFd);
+	if(0 <= outFd)
+		close(outFd);
+	if(all)
+		setenv("LC_ALL", all, 1);
+	else if(! previousAll)
+		unsetenv("LC_ALL");
+	if(ctype)
+		setenv("LC_CTYPE", ctype, 1);
+	else if(! previousCtype)
+		unsetenv("LC_CTYPE");
+	if(previous)
+		setlocale(LC_ALL, previous);
+	optind = previousOptind;
+	free(previous);
+	free(all);
+	free(ctype);
+	errno = error;
+	return rc;
+}
@@ -0,0 +1,2376 @@
+//  libprintfq
+//  The escaping engines behind printfq, separated from the command line processing so that
+// they may be used without running the command.  See printfq.h for the interface.
+
+//  As written, it is assumed that wchar_t stores a Unicode code point for \u and \U output
+// with wide characters, and inside iswprintExt() and iswNotBlank().
+#ifndef __STDC_ISO_10646__
+#warning The Unicode code point mapping has not been tested in this configuration!
+#endif
+
+//  PRINTFQ_NO_FAST_PATHS builds the engines without the classification bitmap and the bulk
+// copies, so that characters are classified directly from the locale and processed one at a
+// time.  That can narrow down where a difference from the reference engine comes from.
+#ifdef PRINTFQ_NO_FAST_PATHS
+	#define FAST_PATHS 0
+#else
+	#define FAST_PATHS 1
+#endif
+
+#define _GNU_SOURCE
+#include "printfq.h"
+#include <ctype.h>  // isprint()
+#include <errno.h>
+#include <langinfo.h> //nl_langinfo
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h> // iswprint()
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+//  PRINTFQ_TRACE instruments the library for profiling.  Each call to printfq_escape_stream() or
+// printfq_decode_stream() keeps a trace of the time it spends reading, writing, and building the
+// classification bitmap, and of the time from the start of each string to its end, which is
+// added to the totals for printfq_trace_get() as the call returns.  When <sys/sdt.h> is
+// available, USDT probes also mark the start and end of each string and each flush.  Without
+// PRINTFQ_TRACE, all of this compiles to nothing.
+#ifdef PRINTFQ_TRACE
+	#include <time.h>
+	#if __has_include(<sys/sdt.h>)
+		#include <sys/sdt.h>
+		#define TRACE_PROBE1(name, a) DTRACE_PROBE1(printfq, name, a)
+		#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(printfq, name, a, b)
+	#else
+		#define TRACE_PROBE1(name, a)
+		#define TRACE_PROBE2(name, a, b)
+	#endif
+
+	static printfq_trace traceTotals;
+	static __thread printfq_trace * currentTrace;
+	static __thread unsigned long long stringStart;
+
+	static unsigned long long traceNow(void)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	//  The value of expr, with the time taken to evaluate it added to the field of the trace
+	#define TRACE_TIME(field, expr) ({ \
+		unsigned long long traceStart = traceNow(); \
+		__typeof__(expr) traceResult = (expr); \
+		if(currentTrace) \
+			currentTrace->field += traceNow() - traceStart; \
+		traceResult; \
+	})
+
+	//  Count the string that has ended in the histogram, and start the next
+	static void traceString(const printfq_output * out)
+	{
+		unsigned long long now = traceNow();
+		if(currentTrace) {
+			unsigned long long ns = now - stringStart;
+			unsigned bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+			currentTrace->strings++;
+			currentTrace->stringNs[PRINTFQ_TRACE_BUCKETS > bucket ? bucket : PRINTFQ_TRACE_BUCKETS - 1]++;
+		}
+		TRACE_PROBE2(string__end, out->stats.strings, out->stats.writtenBytes + (out->pos - out->buf));
+		stringStart = now;
+		TRACE_PROBE1(string__start, out->stats.strings);
+	}
+
+	#define TRACE_BEGIN(out) \
+		printfq_trace trace = {.calls = 1}; \
+		printfq_trace * const outerTrace = currentTrace; \
+		currentTrace = &trace; \
+		stringStart = trace.totalNs = traceNow(); \
+		TRACE_PROBE1(string__start, (out)->stats.strings)
+
+	#define TRACE_END() do { \
+		trace.totalNs = traceNow() - trace.totalNs; \
+		currentTrace = outerTrace; \
+		traceAdd(&traceTotals, &trace); \
+	} while(0)
+
+	static void traceAdd(printfq_trace * totals, const printfq_trace * trace)
+	{
+		const unsigned long long * src = &trace->calls;
+		unsigned long long * dst = &totals->calls;
+		for(size_t i = 0; i < sizeof(*trace) / sizeof(*src); i++)
+			if(src[i])
+				__atomic_fetch_add(dst + i, src[i], __ATOMIC_RELAXED);
+	}
+
+	void printfq_trace_get(printfq_trace * trace)
+	{
+		const unsigned long long * src = &traceTotals.calls;
+		unsigned long long * dst = &trace->calls;
+		for(size_t i = 0; i < sizeof(*trace) / sizeof(*src); i++)
+			dst[i] = __atomic_load_n(src + i, __ATOMIC_RELAXED);
+	}
+#else
+	#define TRACE_PROBE1(name, a)
+	#define TRACE_PROBE2(name, a, b)
+	#define TRACE_TIME(field, expr) (expr)
+	#define TRACE_BEGIN(out)
+	#define TRACE_END() do {} while(0)
+	#define traceString(out)
+#endif
+
+//  In addition to those characters identified by iswprint() as non-printable, this function
+// identifies unicode characters that are invisible by themselves, including 0-space characters.
+// This is a subset of the list at https://invisible-characters.com/.  Space characters from that
+// list with a non-zero width have been omitted here, but appear in iswNotBlank().
+static int iswprintExt(wint_t c)
+{
+	return iswprint(c) &&
+	//  None of the uncommented are excluded by iswprint() in glibc v2.28
+	//  0x9, 0x20 and 0xA0 are non-zero spaces
+	// 0xAD renders in my terminal as a non-zero space, although it shouldn't
+	0xAD != c &&
+	0x034F != c &&
+	0x061C != c &&
+	0x115F != c &&
+	0x1160 != c &&
+	0x17B4 != c &&
+	0x17B5 != c &&
+	(0x180B > c || 0x180E < c) &&
+	//  0x2000 - 0x200A are non-zero spaces
+	(0x200B > c || 0x200F < c) &&
+	(0x202A > c || 0x202E < c) &&
+	//  0x202F and 0x205F are non-zero spaces
+	(0x2060 > c || 0x206F < c) &&
+	//  0x2800, 0x3000, and 0x3164 are non-zero spaces
+	(0xFE00 > c || 0xFE0F < c) &&
+	0xFEFF != c &&
+	0xFFA0 != c &&
+	//  0xFFFC renders as a non-zero space for me, but it shouldn't
+	0xFFFC != c &&
+	// 0x133FC renders as a non-zero space but is, by definition, printable
+	// 0x1D159 renders as a non-zero space for me, but it shouldn't
+	0x1D159 != c &&
+	(0x1D173 > c || 0x1D17A < c) &&
+	0xE0001 != c &&
+	(0xE0020 > c || 0xE007F < c) &&
+	(0xE0100 > c || 0xE01EF < c);
+}
+
+//  This will return true if the character is graphic or is a regular space.
+static int iswNotBlank(wint_t c)
+{
+	//  0x9 and 0x20 are recognized by iswspace().  That aside, 0x20 will not be escaped
+	// (iswprintExt() returns true for it) and iswprintExt() returns false for all other whitespace
+	// characters below 128.  Futhermore, the control characters in the 0x80-0x9F block are
+	// caught by iswprint(), and the only other non-graphic characters below 256 are 0xAD and
+	// 0xA0 which are both explicitly checked for.
+	return iswprintExt(c) && (0x100 > c ? 0xA0 != c : ! (
+		iswspace(c) ||
+		//  None of the uncommented are caught by iswspace() in glibc v2.28
+		//0xA0 == c ||
+		// 0x2000 - 0x2006 are caught by iswspace(), as are 0x2008-0x200A, but not 0x2007
+		//(0x2000 <= c && 0x200A >= c) ||
+		0x2007 == c ||
+		0x202F == c ||
+		//0x205F == c || // caught by iswspace()
+		0x2800 == c ||
+		//0x3000 == c || // caught by iswspace()
+		0x3164 == c
+	));
+}
+
+//  Code point classes, in which each implies the last:  iswprint(), iswprintExt(), and
+// iswNotBlank().  A code point's class is the number of these that are true for it, so each of
+// the -e and -i modes is a comparison against a minimum class.
+#define CLASS_PRINTABLE 1
+#define CLASS_VISIBLE   2
+#define CLASS_NOT_BLANK 3
+
+static unsigned classifyWide(wint_t c)
+{
+	return ! iswprint(c) ? 0 : ! iswprintExt(c) ? CLASS_PRINTABLE :
+		! iswNotBlank(c) ? CLASS_VISIBLE : CLASS_NOT_BLANK;
+}
+
+//  A two level bitmap of the classes of the Unicode code points, with 2 bits per code point in
+// blocks of 256.  Blocks are classified from the current locale the first time that they are
+// needed.  Blocks that are entirely one class share a static copy, and others are allocated.
+// The pointers are published atomically since threads may share the table.
+//  There is a bitmap for each character set, as for localeBytes(), since the classes depend on
+// the locale.  classes is the one for the locale of the last printfq_opts_init() call, or when no
+// call has been made since the locale's character set changed, the first one needed.  Bitmaps
+// are kept for the life of the process.
+#define CLASS_BLOCK_COUNT (0x110000 >> 8)
+#define CLASS_BLOCK_SIZE (256 >> 2)
+struct classTable {
+	struct classTable * next;
+	const unsigned char * blocks[CLASS_BLOCK_COUNT];
+	char codeset[];
+};
+static struct classTable * classTables, * classes;
+static const unsigned char uniformClassBlocks[4][CLASS_BLOCK_SIZE] = {
+	{0},
+	{[0 ... CLASS_BLOCK_SIZE - 1] = 0x55},
+	{[0 ... CLASS_BLOCK_SIZE - 1] = 0xAA},
+	{[0 ... CLASS_BLOCK_SIZE - 1] = 0xFF}
+};
+
+//  Make the bitmap for the current locale's character set the one in classes, and return it, or
+// NULL if it cannot be allocated
+static struct classTable * selectClassTable(void)
+{
+	const char * codeset = nl_langinfo(CODESET);
+	struct classTable * t;
+	for(t = __atomic_load_n(&classTables, __ATOMIC_ACQUIRE); t; t = t->next)
+		if(! strcmp(codeset, t->codeset))
+			break;
+	if(! t) {
+		size_t len = strlen(codeset) + 1;
+		if(! (t = calloc(1, sizeof(*t) + len)))
+			return NULL;
+		memcpy(t->codeset, codeset, len);
+		//  Another thread may add the same table, in which case both are valid
+		t->next = __atomic_load_n(&classTables, __ATOMIC_ACQUIRE);
+		while(! __atomic_compare_exchange_n(&classTables, &t->next, t, 0, __ATOMIC_ACQ_REL,
+			__ATOMIC_ACQUIRE));
+	}
+	__atomic_store_n(&classes, t, __ATOMIC_RELEASE);
+	return t;
+}
+
+static void classifyBlock(unsigned char bits[CLASS_BLOCK_SIZE], unsigned index)
+{
+	memset(bits, 0, CLASS_BLOCK_SIZE);
+	for(unsigned i = 0; i < 256; i++)
+		bits[i >> 2] |= classifyWide(index << 8 | i) << ((i & 3) << 1);
+}
+
+static const unsigned char * buildClassBlock(struct classTable * t, unsigned index)
+{
+	unsigned char bits[CLASS_BLOCK_SIZE];
+	classifyBlock(bits, index);
+	const unsigned char * block = NULL;
+	for(unsigned i = 0; i < 4 && ! block; i++)
+		if(! memcmp(bits, uniformClassBlocks[i], CLASS_BLOCK_SIZE))
+			block = uniformClassBlocks[i];
+	if(! block) {
+		unsigned char * copy = malloc(CLASS_BLOCK_SIZE);
+		if(! copy)
+			return NULL;
+		block = memcpy(copy, bits, CLASS_BLOCK_SIZE);
+	}
+	const unsigned char * expected = NULL;
+	if(! __atomic_compare_exchange_n(t->blocks + index, &expected, block, 0, __ATOMIC_ACQ_REL,
+		__ATOMIC_ACQUIRE))
+	{
+		//  Another thread got here first
+		if(block < uniformClassBlocks[0] || block > uniformClassBlocks[3])
+			free((void *)block);
+		block = expected;
+	}
+	return block;
+}
+
+static unsigned codePointClassSlow(wint_t c)
+{
+	struct classTable * t = __atomic_load_n(&classes, __ATOMIC_ACQUIRE);
+	const unsigned char * block;
+	if(0x110000 > (uint32_t)c && (t || (t = selectClassTable())) &&
+		(block = TRACE_TIME(classifyNs, buildClassBlock(t, c >> 8))))
+		return block[(c & 0xFF) >> 2] >> ((c & 3) << 1) & 3;
+	return classifyWide(c);
+}
+
+static inline unsigned codePointClass(wint_t c)
+{
+	const struct classTable * t;
+	const unsigned char * block;
+	if(! FAST_PATHS)
+		return classifyWide(c);
+	if(__builtin_expect(0x110000 > (uint32_t)c, 1) &&
+		(t = __atomic_load_n(&classes, __ATOMIC_ACQUIRE)) &&
+		(block = __atomic_load_n(t->blocks + (c >> 8), __ATOMIC_ACQUIRE)))
+		return block[(c & 0xFF) >> 2] >> ((c & 3) << 1) & 3;
+	return codePointClassSlow(c);
+}
+
+//  The class of a code point decoded from UTF-8.  PRINTFQ_STATIC_CLASSES builds take this from
+// tables that were generated from a UTF-8 locale at build time, by the PRINTFQ_GENERATE_CLASSES
+// program at the end of this file, so that UTF-8 input can be escaped without any locale data
+// having been loaded.
+#ifdef PRINTFQ_STATIC_CLASSES
+#include "printfq-classes.h"
+#endif
+
+static inline unsigned utf8CodePointClass(wint_t c)
+{
+	#ifdef PRINTFQ_STATIC_CLASSES
+	if(__builtin_expect(0x110000 > (uint32_t)c, 1))
+		return staticClassBlocks[staticClassIndex[c >> 8]][(c & 0xFF) >> 2] >> ((c & 3) << 1) & 3;
+	return 0;
+	#else
+	return codePointClass(c);
+	#endif
+}
+
+static inline unsigned minimumClass(unsigned flags)
+{
+	return flags & PRINTFQ_ESCAPE_MORE ? CLASS_NOT_BLANK :
+		flags & PRINTFQ_ESCAPE_INVISIBLE ? CLASS_VISIBLE : CLASS_PRINTABLE;
+}
+
+//  These are characters that must always be escaped or quoted
+// to avoid interpretation by the shell.  See
+// https://pubs.opengroup.org/onlinepubs/9699919799/utilities/V3_chap02.html#tag_18_02
+// = and % have been omitted here since, at least as an argument, it does not appear to be
+// possible to mis-interpret them.  The tilde (~) has specific handling.  There is room
+// for improvement with the other contextual escapes: *, ?, [, and #.
+// ^ is escaped in case the escaped string is placed inside a bracket expansion (bash
+// recognizes it).  Perhaps an argument indicating that the output will not be used as a
+// test argument would make sense?
+static const char shControlChars[] = {
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 1, 1, 0, 0, 0, 0, 0,	// tab, newline
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 1, 0, 1, 1, // space ! " # $ & '
+	1, 1, 1, 0, 1, 0, 0, 0, // ( ) * comma
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 1, 1, 0, 1, 1, // ; < > ?
+
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 1, 1, 1, 1, 0, // [ \ ] ^
+	1, 0, 0, 0, 0, 0, 0, 0, // `
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 1, 1, 1, 0, 0  // { | }
+};
+//  These are non-printable characters that have defined escapes inside $'' quoting,
+// and whose escapes are the indicated letters.
+static const char ansiEscapes[] = {
+	0,   0,   0,   0,   0,   0,   0,   'a', // bell
+	// backspace, tab, newline, vertical tab, form feed, carriage return
+	'b', 't', 'n', 'v', 'f', 'r', 0,   0,
+	0,   0,   0,   0,   0,   0,   0,   0,
+	0,   0,   0, 'E'  // escape
+};
+
+//  Input and output helpers, modeled after their stdio counterparts
+static int inRefill(printfq_input * in)
+{
+	if(in->refill) {
+		ssize_t rc = TRACE_TIME(readNs, in->refill(in));
+		if(0 > rc)
+			in->error = errno ? errno : EIO;
+		else if(rc)
+			return in->pos < in->end;
+	}
+	return 0;
+}
+
+static inline __attribute__((always_inline)) int inGetc(printfq_input * in)
+{
+	return in->pos < in->end || inRefill(in) ? *in->pos++ : EOF;
+}
+
+//  Return the next byte without consuming it
+static inline __attribute__((always_inline)) int inPeek(printfq_input * in)
+{
+	return in->pos < in->end || inRefill(in) ? *in->pos : EOF;
+}
+
+static int outFlush(printfq_output * out)
+{
+	size_t pending = out->pos - out->buf;
+	out->stats.flushes++;
+	TRACE_PROBE1(flush, pending);
+	if(TRACE_TIME(writeNs, out->flush(out))) {
+		out->error = errno ? errno : EIO;
+		//  Discard the unwritable output so that processing can continue to a stopping point
+		out->pos = out->buf;
+		return EOF;
+	}
+	//  A flush that makes room by growing the buffer consumes nothing
+	out->stats.writtenBytes += pending - (out->pos - out->buf);
+	return 0;
+}
+
+static inline __attribute__((always_inline)) int outPutc(int c, printfq_output * out)
+{
+	if(out->pos == out->end && outFlush(out))
+		return EOF;
+	*out->pos++ = c;
+	return (unsigned char)c;
+}
+
+static int outWriteSlow(const void * ptr, size_t size, printfq_output * out)
+{
+	const char * src = ptr;
+	size_t avail;
+	if(out->write && size >= (size_t)(out->end - out->buf) >> 1) {
+		//  Hand large blocks to the sink along with the buffer rather than copying them
+		size_t pending = out->pos - out->buf;
+		out->stats.flushes++;
+		TRACE_PROBE1(flush, pending + size);
+		if(TRACE_TIME(writeNs, out->write(out, ptr, size))) {
+			out->error = errno ? errno : EIO;
+			out->pos = out->buf;
+			return EOF;
+		}
+		out->stats.writtenBytes += pending + size;
+		return 0;
+	}
+	while(size > (avail = out->end - out->pos)) {
+		memcpy(out->pos, src, avail);
+		out->pos += avail;
+		src += avail;
+		size -= avail;
+		if(outFlush(out))
+			return EOF;
+	}
+	memcpy(out->pos, src, size);
+	out->pos += size;
+	return 0;
+}
+
+static inline __attribute__((always_inline)) int outWrite(const void * ptr, size_t size,
+	printfq_output * out)
+{
+	if(size > (size_t)(out->end - out->pos))
+		return outWriteSlow(ptr, size, out);
+	memcpy(out->pos, ptr, size);
+	out->pos += size;
+	return 0;
+}
+
+static inline __attribute__((always_inline)) int outPuts(const char * s, printfq_output * out)
+{
+	return outWrite(s, strlen(s), out);
+}
+
+//  The number of bytes output so far
+static inline __attribute__((always_inline)) size_t outCount(const printfq_output * out)
+{
+	return out->stats.writtenBytes + (out->pos - out->buf);
+}
+
+//  Count a string that has ended, if ended, and pass the position after it to the record callback
+static inline __attribute__((always_inline)) void outEndString(unsigned ended,
+	const printfq_input * in, printfq_output * out)
+{
+	if(ended) {
+		out->stats.strings++;
+		traceString(out);
+		if(out->record)
+			out->record(out, in);
+	}
+}
+
+//  End a quoted segment that started when outCount() was start
+static inline __attribute__((always_inline)) int outCloseQuote(size_t start, printfq_output * out)
+{
+	int rc = outPutc('\'', out);
+	out->stats.quotedSegments++;
+	out->stats.quotedBytes += outCount(out) - start;
+	return rc;
+}
+
+//  Precomputed escape sequences, so that formatting an escape is a table lookup.  octalEscapes
+// has the 3 digit form of every byte, and shortOctalEscapes has the form without leading zeros
+// for the bytes where that is shorter.
+struct escapeText {
+	char text[4];
+	unsigned char size;
+};
+
+#define OCTAL_ESCAPE(c) {{'\\', '0' + ((c) >> 6), '0' + ((c) >> 3 & 7), '0' + ((c) & 7)}, 4},
+#define SHORT_OCTAL_ESCAPE(c) {{'\\', '0' + (07 < (c) ? (c) >> 3 : (c)), 07 < (c) ? '0' + ((c) & 7) : 0}, \
+	07 < (c) ? 3 : 2},
+#define REPEAT8(m, c) m(c) m((c) + 1) m((c) + 2) m((c) + 3) m((c) + 4) m((c) + 5) m((c) + 6) m((c) + 7)
+#define REPEAT64(m, c) REPEAT8(m, c) REPEAT8(m, (c) + 8) REPEAT8(m, (c) + 16) REPEAT8(m, (c) + 24) \
+	REPEAT8(m, (c) + 32) REPEAT8(m, (c) + 40) REPEAT8(m, (c) + 48) REPEAT8(m, (c) + 56)
+static const struct escapeText octalEscapes[256] = {
+	REPEAT64(OCTAL_ESCAPE, 0) REPEAT64(OCTAL_ESCAPE, 64)
+	REPEAT64(OCTAL_ESCAPE, 128) REPEAT64(OCTAL_ESCAPE, 192)
+};
+static const struct escapeText shortOctalEscapes[64] = {
+	REPEAT64(SHORT_OCTAL_ESCAPE, 0)
+};
+#undef REPEAT64
+#undef REPEAT8
+#undef SHORT_OCTAL_ESCAPE
+#undef OCTAL_ESCAPE
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+//  Output byte c as an octal escape.  All 3 digits are output with threeDigits, which must be
+// set when a following octal digit would be taken as part of the escape.
+static inline __attribute__((always_inline)) int outOctalEscape(unsigned c, unsigned threeDigits,
+	printfq_output * out)
+{
+	const struct escapeText * e = threeDigits || 077 < c ? &octalEscapes[c] : &shortOctalEscapes[c];
+	out->stats.octalEscapes++;
+	return outWrite(e->text, e->size, out);
+}
+
+static inline __attribute__((always_inline)) int outAnsiEscape(unsigned c, printfq_output * out)
+{
+	const char text[2] = {'\\', ansiEscapes[c]};
+	out->stats.ansiEscapes++;
+	return outWrite(text, sizeof(text), out);
+}
+
+//  Output a \u or \U escape, per the letter in prefix, with at least minDigits hex digits
+static int outHexEscape(char prefix, uint32_t c, unsigned minDigits, printfq_output * out)
+{
+	char buff[10];
+	char * p = buff + sizeof(buff);
+	if('U' == prefix)
+		out->stats.longUnicodeEscapes++;
+	else
+		out->stats.unicodeEscapes++;
+	do {
+		*(--p) = hexDigits[c & 0xF];
+		c >>= 4;
+	} while(c || buff + sizeof(buff) - p < (ptrdiff_t)minDigits);
+	*(--p) = prefix;
+	*(--p) = '\\';
+	return outWrite(p, buff + sizeof(buff) - p, out);
+}
+
+//  Long runs of ASCII that need no escaping are copied in bulk.  A byte is safe to copy when it
+// is printable ASCII, which it is in every locale, and it is not in shControlChars.  The tilde
+// is safe since it is only special at the start of a string, which is handled separately.
+static inline int isSafeAscii(unsigned char c)
+{
+	return 0x20 < c && 0x7F > c && ! shControlChars[c];
+}
+
+static size_t safeAsciiSpanScalar(const unsigned char * s, size_t len)
+{
+	size_t idx = 0;
+	while(idx < len && isSafeAscii(s[idx]))
+		idx++;
+	return idx;
+}
+
+#if defined(__SSE2__) || (defined(__aarch64__) && defined(__ARM_NEON))
+//  Nibble lookup tables for the vector scanners.  Each bit of safeHighNibble corresponds to one
+// of the high nibbles 2 - 7, and safeLowNibble has that bit set for each low nibble that makes
+// a safe byte with that high nibble.  A byte is safe when the table entries for its two
+// nibbles share a bit.  The safe bytes are:
+// %+-./0123456789:=@ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz~
+static const unsigned char safeLowNibble[16] __attribute__((aligned(16))) = {
+	0x2E, 0x3E, 0x3E, 0x3E, 0x3E, 0x3F, 0x3E, 0x3E,
+	0x3E, 0x3E, 0x3E, 0x15, 0x14, 0x17, 0x35, 0x1D
+};
+static const unsigned char safeHighNibble[16] __attribute__((aligned(16))) = {
+	0x00, 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+#endif
+
+#ifdef __SSE2__
+//  SSE2 has no byte shuffle, so the safe bytes are tested as ranges.  Adding 0x80 - lo maps
+// lo - hi to the bottom of the signed range, so that a single signed comparison checks both
+// ends of the range.
+#define SSE2_IN_RANGE(x, lo, hi) _mm_cmplt_epi8(_mm_add_epi8((x), _mm_set1_epi8((char)(0x80 - (lo)))), \
+	_mm_set1_epi8((char)(0x80 + (hi) - (lo) + 1)))
+
+static size_t safeAsciiSpanSse2(const unsigned char * s, size_t len)
+{
+	size_t idx = 0;
+	for(; idx + 16 <= len; idx += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(s + idx));
+		__m128i safe = _mm_or_si128(
+			_mm_or_si128(
+				_mm_or_si128(SSE2_IN_RANGE(x, 0x2D, 0x3A), SSE2_IN_RANGE(x, 0x40, 0x5A)),
+				_mm_or_si128(SSE2_IN_RANGE(x, 0x61, 0x7A), _mm_cmpeq_epi8(x, _mm_set1_epi8(0x25)))
+			),
+			_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(0x2B)), _mm_cmpeq_epi8(x, _mm_set1_epi8(0x3D))),
+				_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(0x5F)), _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7E)))
+			)
+		);
+		unsigned unsafe = ~_mm_movemask_epi8(safe) & 0xFFFF;
+		if(unsafe)
+			return idx + __builtin_ctz(unsafe);
+	}
+	return idx + safeAsciiSpanScalar(s + idx, len - idx);
+}
+
+__attribute__((target("avx2")))
+static size_t safeAsciiSpanAvx2(const unsigned char * s, size_t len)
+{
+	const __m256i lowTable = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)safeLowNibble));
+	const __m256i highTable = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)safeHighNibble));
+	const __m256i nibbleMask = _mm256_set1_epi8(0x0F);
+	size_t idx = 0;
+	for(; idx + 32 <= len; idx += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(s + idx));
+		__m256i lowBits = _mm256_shuffle_epi8(lowTable, _mm256_and_si256(x, nibbleMask));
+		__m256i highBits = _mm256_shuffle_epi8(highTable,
+			_mm256_and_si256(_mm256_srli_epi16(x, 4), nibbleMask));
+		unsigned unsafe = _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_and_si256(lowBits, highBits), _mm256_setzero_si256()));
+		if(unsafe)
+			return idx + __builtin_ctz(unsafe);
+	}
+	return idx + safeAsciiSpanSse2(s + idx, len - idx);
+}
+
+//  Returns the number of safe bytes at the start of s
+static size_t safeAsciiSpan(const unsigned char * s, size_t len)
+{
+	//  Most runs are short.  Avoid the vector setup when the first couple of bytes end it.
+	if(len < 16 || ! isSafeAscii(*s) || ! isSafeAscii(s[1]))
+		return safeAsciiSpanScalar(s, len);
+	return len >= 64 && __builtin_cpu_supports("avx2") ?
+		safeAsciiSpanAvx2(s, len) : safeAsciiSpanSse2(s, len);
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static size_t safeAsciiSpan(const unsigned char * s, size_t len)
+{
+	if(len < 16 || ! isSafeAscii(*s) || ! isSafeAscii(s[1]))
+		return safeAsciiSpanScalar(s, len);
+	const uint8x16_t lowTable = vld1q_u8(safeLowNibble);
+	const uint8x16_t highTable = vld1q_u8(safeHighNibble);
+	size_t idx = 0;
+	for(; idx + 16 <= len; idx += 16) {
+		uint8x16_t x = vld1q_u8(s + idx);
+		uint8x16_t safe = vtstq_u8(vqtbl1q_u8(lowTable, vandq_u8(x, vdupq_n_u8(0x0F))),
+			vqtbl1q_u8(highTable, vshrq_n_u8(x, 4)));
+		//  Narrow each result byte to a nibble to find the first unsafe byte
+		uint64_t unsafe = ~vget_lane_u64(vreinterpret_u64_u8(
+			vshrn_n_u16(vreinterpretq_u16_u8(safe), 4)), 0);
+		if(unsafe)
+			return idx + (__builtin_ctzll(unsafe) >> 2);
+	}
+	return idx + safeAsciiSpanScalar(s + idx, len - idx);
+}
+#else
+#define safeAsciiSpan safeAsciiSpanScalar
+#endif
+
+//  Copy the run of safe bytes at the input position to the output
+static inline __attribute__((always_inline)) void copySafeAscii(printfq_input * in,
+	printfq_output * out)
+{
+	if(! FAST_PATHS)
+		return;
+	size_t size = safeAsciiSpan(in->pos, in->end - in->pos);
+	if(size) {
+		outWrite(in->pos, size, out);
+		in->pos += size;
+	}
+}
+
+//  Decoding state for the library's conversion of non-UTF-8 multibyte input.  getWideChar()
+// returns the next character in the input, or WEOF at the end of the input or on a decoding
+// error.  cbuff and bytesInChar hold the encoded bytes of the returned character so that it
+// may be output without converting it back.  ungetWideChar() may only be called with the
+// last character returned by getWideChar().
+struct wideDecoder {
+	printfq_input * in;
+	wint_t lastChar;
+	//  The table of a single byte character set, for the byte engine
+	const struct localeBytes * bytes;
+	unsigned pushedBack;
+	unsigned bytesInChar;
+	unsigned char cbuff[MB_LEN_MAX];
+	//  Set to EILSEQ after a decoding error, after which only WEOF is returned
+	int error;
+};
+
+static wint_t getWideChar(struct wideDecoder * d)
+{
+	if(d->pushedBack) {
+		d->pushedBack = 0;
+		return d->lastChar;
+	}
+	d->bytesInChar = 0;
+	if(! d->error) {
+		mbstate_t state;
+		memset(&state, 0, sizeof(state));
+		int c;
+		while(EOF != (c = inGetc(d->in))) {
+			char byte = c;
+			wchar_t wc;
+			d->cbuff[d->bytesInChar++] = c;
+			size_t rc = mbrtowc(&wc, &byte, 1, &state);
+			if((size_t)-2 != rc) {
+				if((size_t)-1 == rc)
+					break;
+				return d->lastChar = wc;
+			}
+			if(sizeof(d->cbuff) == d->bytesInChar)
+				break;
+		}
+		//  A partial character at the end of the input is also a decoding error
+		if(d->bytesInChar)
+			d->error = EILSEQ;
+	}
+	return d->lastChar = WEOF;
+}
+
+static inline void ungetWideChar(struct wideDecoder * d, wint_t c)
+{
+	//  As with ungetwc(), pushing back WEOF does nothing
+	if(WEOF != c)
+		d->pushedBack = 1;
+}
+
+//  In a locale where every character is a single byte, mbrtowc() is no more than a lookup, so
+// the result for each byte is looked up in a table instead.  The table also holds the class of
+// each character plus one, or 0 for characters that are never copied as-is:  invalid bytes, the
+// null character, and the shell's special characters.  Tables are built from the current locale
+// the first time that each character set is used, and are kept for the life of the process since
+// threads may share them.
+struct localeBytes {
+	struct localeBytes * next;
+	wint_t chars[256];
+	unsigned char safeClass[256];
+	char codeset[];
+};
+
+static const struct localeBytes * localeBytes(void)
+{
+	static struct localeBytes * tables;
+	const char * codeset = nl_langinfo(CODESET);
+	struct localeBytes * t;
+	for(t = __atomic_load_n(&tables, __ATOMIC_ACQUIRE); t; t = t->next)
+		if(! strcmp(codeset, t->codeset))
+			return t;
+	size_t len = strlen(codeset) + 1;
+	if(! (t = malloc(sizeof(*t) + len)))
+		return NULL;
+	memcpy(t->codeset, codeset, len);
+	for(unsigned i = 0; i < 256; i++) {
+		wint_t c = t->chars[i] = btowc(i);
+		t->safeClass[i] = WEOF == c || 0 == c || (c < sizeof(shControlChars) && shControlChars[c]) ?
+			0 : classifyWide(c) + 1;
+	}
+	//  Another thread may add the same table, in which case both are valid
+	t->next = __atomic_load_n(&tables, __ATOMIC_ACQUIRE);
+	while(! __atomic_compare_exchange_n(&tables, &t->next, t, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return t;
+}
+
+//  getWideChar() for the wide engine, or a table lookup for the byte engine
+static inline __attribute__((always_inline)) wint_t getLocaleChar(struct wideDecoder * d,
+	unsigned singleByte)
+{
+	if(! singleByte)
+		return getWideChar(d);
+	if(d->pushedBack) {
+		d->pushedBack = 0;
+		return d->lastChar;
+	}
+	int c;
+	d->bytesInChar = 0;
+	if(d->error || EOF == (c = inGetc(d->in)))
+		return d->lastChar = WEOF;
+	d->cbuff[0] = c;
+	d->bytesInChar = 1;
+	if(WEOF == (d->lastChar = d->bytes->chars[c]))
+		d->error = EILSEQ;
+	return d->lastChar;
+}
+
+//  Copy the run of bytes at the input position that the byte engine would output as-is.  These
+// are those with a safe class above threshold.
+static inline void copySafeBytes(struct wideDecoder * d, printfq_output * out, unsigned threshold)
+{
+	printfq_input * in = d->in;
+	const unsigned char * p = in->pos;
+	if(d->pushedBack)
+		return;
+	while(p < in->end && threshold < d->bytes->safeClass[*p])
+		p++;
+	if(p != in->pos) {
+		outWrite(in->pos, p - in->pos, out);
+		in->pos = p;
+	}
+}
+
+//  Decoding state for UTF-8 input.  It is apparently impossible to recover after a decoding
+// error with getwc() without closing the stream and losing input.  clearerr() and fflush() do
+// nothing to recover from a decoding error.  The next alternative is using a regular byte
+// oriented stream and the library's wide string conversion functions, but recovering from
+// errors with the conversion function requires digging into the opaque mbstate_t object.
+// Hence getUtf8CodePoint(), so that unrecognized characters can be pushed to the output
+// without loss.
+struct utf8Decoder {
+	printfq_input * in;
+	//  Starting at cbuff, bytesInCodePoint indicates how many bytes are used by the returned
+	// code point.  This is set to zero if an encoding error or EOF are detected, in which case
+	// cbuff should not be used.  When byteInCodePoint is 0, the return code will be the byte
+	// at the location of the error, or EOF.  cbuff points into the input buffer and is only
+	// valid until the input is read again.  It is intended for use by the caller for outputting
+	// raw UTF-8 w/o coverting the code point back to UTF-8.
+	const unsigned char * cbuff;
+	unsigned bytesInCodePoint;
+};
+
+//  Try to make size bytes available at in->pos.  Returns the number of bytes available.
+static size_t inFill(printfq_input * in, size_t size)
+{
+	size_t avail;
+	while(size > (avail = in->end - in->pos) && inRefill(in));
+	return avail;
+}
+
+static inline int isUtf8Continuation(unsigned char c)
+{
+	return (c & 0xC0) == 0x80;
+}
+
+//  When there is no error, getUtf8CodePoint() returns the next code point in the
+// input.  cbuff and bytesInCodePoint are additional return values.  Invalid bytes are returned
+// one at a time, and decoding resumes with the byte after an invalid one.
+static int32_t getUtf8CodePoint(struct utf8Decoder * d)
+{
+	printfq_input * in = d->in;
+	if(in->pos == in->end && ! inRefill(in)) {
+		d->bytesInCodePoint = 0;
+		return EOF;
+	}
+	int32_t rc = *in->pos;
+	const unsigned char * s;
+	if(0x80 > rc) {
+		d->bytesInCodePoint = 1;
+		d->cbuff = in->pos++;
+		return rc;
+	}
+	//  0x80 - 0xC1 are continuation bytes or would only start overlong sequences, and
+	// 0xF5 and above would only start sequences that decode past 0x10FFFF.
+	unsigned expectedBytes = 0xC2 > rc ? 0 : 0xE0 > rc ? 2 : 0xF0 > rc ? 3 : 0xF5 > rc ? 4 : 0;
+	if(expectedBytes) {
+		size_t avail = in->end - in->pos;
+		if(avail < expectedBytes) {
+			//  Only wait for more input if the sequence could still be valid
+			s = in->pos;
+			while(--avail && isUtf8Continuation(*(++s)));
+			if(! avail)
+				inFill(in, expectedBytes);
+		}
+		s = in->pos;
+		if((size_t)(in->end - s) >= expectedBytes && isUtf8Continuation(s[1])) {
+			if(2 == expectedBytes) {
+				// 0x800 > rc, and 0x7F < rc since the lead byte is at least 0xC2
+				rc = (int32_t)(*s & 0x1F) << 6 | (int32_t)(s[1] & 0x3F);
+				goto valid;
+			}
+			else if(isUtf8Continuation(s[2])) {
+				if(3 == expectedBytes) {
+					rc = (int32_t)(*s & 0x0F) << 12
+					| (int32_t)(s[1] & 0x3F) << 6
+					| (int32_t)(s[2] & 0x3F);
+					// 0x10000 > rc is guaranteed by the bit handling
+					if(0x7FF < rc
+						// Disallow UTF-16 surrogates
+						&& (0xD800 > rc || 0xDFFF < rc)
+						// Noncharacters are permissible.
+						//&& (0xFDD0 > rc || 0xFDEF < rc) && 0xFFFE > rc
+					)
+						goto valid;
+				}
+				else if(isUtf8Continuation(s[3])) {
+					rc = (int32_t)(*s & 0x07) << 18
+					| (int32_t)(s[1] & 0x3F) << 12
+					| (int32_t)(s[2] & 0x3F) << 6
+					| (int32_t)(s[3] & 0x3F);
+					if(0xFFFF < rc
+						//  Code points > 0x10FFFF are invalid.
+						&& 0x110000 > rc
+						// Noncharacters are permissible.
+						//&& 0xFFFF != (rc & 0xFFFF) && 0xFFFE != (rc & 0xFFFF)
+					)
+						goto valid;
+				}
+			}
+		}
+	}
+	d->bytesInCodePoint = 0;
+	return *in->pos++;
+valid:
+	d->bytesInCodePoint = expectedBytes;
+	d->cbuff = s;
+	in->pos += expectedBytes;
+	return rc;
+}
+
+//  Copy the run of safe ASCII and valid, printable multibyte characters at the input position.
+// Bare output is the same for all of them, so they are validated and classified here without
+// being returned one by one, and written with a single copy.  Characters that are split across
+// the end of the buffer are left for getUtf8CodePoint().
+static void copySafeUtf8(printfq_input * in, printfq_output * out, unsigned printableClass)
+{
+	const unsigned char * s = in->pos;
+	const unsigned char * end = in->end;
+	if(! FAST_PATHS)
+		return;
+	while(s < end) {
+		int32_t c = *s;
+		size_t size;
+		if(0x80 > c) {
+			if(! (size = safeAsciiSpan(s, end - s)))
+				break;
+		}
+		else if(0xC2 > c || 0xF5 <= c)
+			break;
+		else if(0xE0 > c) {
+			if(2 > end - s || ! isUtf8Continuation(s[1]))
+				break;
+			c = (c & 0x1F) << 6 | (s[1] & 0x3F);
+			size = 2;
+		}
+		else if(0xF0 > c) {
+			if(3 > end - s || ! isUtf8Continuation(s[1]) || ! isUtf8Continuation(s[2]))
+				break;
+			c = (c & 0x0F) << 12 | (s[1] & 0x3F) << 6 | (s[2] & 0x3F);
+			if(0x800 > c || (0xD800 <= c && 0xDFFF >= c))
+				break;
+			size = 3;
+		}
+		else {
+			if(4 > end - s || ! isUtf8Continuation(s[1]) || ! isUtf8Continuation(s[2]) ||
+				! isUtf8Continuation(s[3]))
+				break;
+			c = (c & 0x07) << 18 | (s[1] & 0x3F) << 12 | (s[2] & 0x3F) << 6 | (s[3] & 0x3F);
+			if(0x10000 > c || 0x110000 <= c)
+				break;
+			size = 4;
+		}
+		if(1 < size && printableClass > utf8CodePointClass((wint_t)c))
+			break;
+		s += size;
+	}
+	if(s != in->pos) {
+		outWrite(in->pos, s - in->pos, out);
+		in->pos = s;
+	}
+}
+
+//  The ASCII handling is also used with a UTF-8 locale when not escaping
+// non-printable characters since it is functionally equivalent in that case
+// and avoids additional conditionals in the UTF-8 handling.
+static inline __attribute__((always_inline)) int escapeNarrowKernel(unsigned variant, unsigned flags,
+	printfq_input * in, printfq_output * out)
+{
+	const unsigned disableCQuoting = variant & PRINTFQ_MINIMAL;
+	const unsigned flushArguments = flags & PRINTFQ_FLUSH_ARGUMENTS;
+	const unsigned ignoreNullInput = flags & PRINTFQ_IGNORE_NULL_INPUT;
+	const unsigned nullTerminatedOutput = flags & PRINTFQ_NULL_TERMINATED_OUTPUT;
+	//  The \E escape for the escape character (0x1B) is recognized by bash, ksh, and zsh,
+	// but it is not recognized by busybox sh.
+	const unsigned ansiEscapesLimit = variant & PRINTFQ_UNICODE_ESCAPES ? sizeof(ansiEscapes) : 14;
+	int c = inGetc(in);
+	unsigned isPrintable;
+	size_t quoteStart;
+	if('~' == c) {
+		isPrintable = 1;
+		goto narrowCharStartEscape;
+	}
+	do {
+		if(0 < c) {
+			do {
+				isPrintable = disableCQuoting || isprint(c);
+				if(((unsigned)c < sizeof(shControlChars) && shControlChars[c]) || ! isPrintable) {
+					narrowCharStartEscape:
+					if('\'' == c || ({
+						quoteStart = outCount(out);
+						if(disableCQuoting) {
+							outPutc('\'', out);
+							do
+								outPutc(c, out);
+							while(0 < (c = inGetc(in)) && '\'' != c);
+						}
+						else {
+							outPuts("$'", out);
+							do
+								if(isPrintable)
+									if('\\' == c)
+										outPuts("\\\\", out);
+									else if('\'' == c)
+										outPuts("\\'", out);
+									else
+										outPutc(c, out);
+								else if((unsigned)c < ansiEscapesLimit && ansiEscapes[c])
+									outAnsiEscape(c, out);
+								else
+									outOctalEscape(c, 077 < c || ({
+											//  Peak at the next character.  If it's not a
+											// valid octal digit, print less than 3 digits.
+											int nextc = inPeek(in);
+											'7' >= nextc && '0' <= nextc;
+										}), out
+									);
+							while(0 < (c = inGetc(in)) && ({
+								isPrintable = isprint(c);
+								1;
+							}));
+						}
+						outCloseQuote(quoteStart, out);
+						'\'' == c;
+					}))
+						outPuts("\\\'", out);
+					else if(0 >= c)
+						break;
+				}
+				else {
+					outPutc(c, out);
+					copySafeAscii(in, out);
+				}
+				c = inGetc(in);
+			} while(0 < c);
+		}
+		else
+			outPuts("''", out);
+	} while(outEndString(0 != c || ! ignoreNullInput, in, out), 0 == c ? (
+			//  The terminator of a string from null terminated input does not depend on what
+			// follows it, so it is written before the next character is read.  Output that is
+			// flushed while that read waits then ends with a complete string.
+			(ignoreNullInput || ! nullTerminatedOutput || (EOF != outPutc(0, out) &&
+				(! flushArguments || EOF != outFlush(out)))) && EOF != (c = inGetc(in)) ? ({
+				unsigned rc = ignoreNullInput || nullTerminatedOutput || EOF != outPutc(' ', out);
+				if('~' == c && rc) {
+					isPrintable = 1;
+					goto narrowCharStartEscape;
+				}
+				rc;
+			}) : ({
+				if(ignoreNullInput && nullTerminatedOutput)
+					outPutc(0, out);
+				0;
+			})
+		) : ({
+			if(ignoreNullInput && nullTerminatedOutput)
+				outPutc(0, out);
+			0;
+		})
+	);
+	return 0;
+}
+
+//  Selects the byte engine's table lookups in the wide engine's variants
+#define VARIANT_SINGLE_BYTE 0x100
+
+//  The locale does not use UTF-8 encoding.  Deference is given to the library
+// including, unfortunately, its error handling.  This code has not been tested
+// in MS Windows (would a POSIX shell even work with UTF-16???)
+//  With VARIANT_SINGLE_BYTE, this is the byte engine, which decodes with localeBytes() and
+// copies runs of safe bytes as-is.  The output is the same.
+static inline __attribute__((always_inline)) int escapeWideKernel(unsigned variant, unsigned flags,
+	printfq_input * in, printfq_output * out)
+{
+	const unsigned singleByte = variant & VARIANT_SINGLE_BYTE;
+	const unsigned printableClass = minimumClass(variant);
+	const unsigned disableCQuoting = variant & PRINTFQ_MINIMAL;
+	const unsigned useUnicodeEscapes = variant & PRINTFQ_UNICODE_ESCAPES;
+	const unsigned flushArguments = flags & PRINTFQ_FLUSH_ARGUMENTS;
+	const unsigned ignoreNullInput = flags & PRINTFQ_IGNORE_NULL_INPUT;
+	const unsigned nullTerminatedOutput = flags & PRINTFQ_NULL_TERMINATED_OUTPUT;
+	const unsigned ansiEscapesLimit = useUnicodeEscapes ? sizeof(ansiEscapes) : 14;
+	struct wideDecoder d = {.in = in, .bytes = singleByte ? localeBytes() : NULL};
+	wint_t c = getLocaleChar(&d, singleByte);
+	unsigned isPrintable;
+	//  Input that cannot be decoded at its very start is output as '', but is not counted as a
+	// string, so that a caller escaping input in pieces can tell that nothing else was output for it
+	unsigned undecodable = 0;
+	size_t quoteStart;
+	if(L'~' == c) {
+		isPrintable = 1;
+		goto wideCharStartEscape;
+	}
+	do {
+		if(0 != c && WEOF != c) {
+			do {
+				isPrintable = disableCQuoting || printableClass <= codePointClass(c);
+				if((c < sizeof(shControlChars) && shControlChars[c]) || ! isPrintable) {
+					wideCharStartEscape:
+					if(L'\'' == c || ({
+						quoteStart = outCount(out);
+						if(disableCQuoting) {
+							outPutc('\'', out);
+							do
+								outWrite(d.cbuff, d.bytesInChar, out);
+							while(0 != (c = getLocaleChar(&d, singleByte)) && WEOF != c && '\'' != c);
+						}
+						else {
+							outPuts("$'", out);
+							do {
+								if(isPrintable)
+									if(L'\\' == c)
+										outPuts("\\\\", out);
+									else if(L'\'' == c)
+										outPuts("\\'", out);
+									else
+										outWrite(d.cbuff, d.bytesInChar, out);
+								else if(128 > c)
+									if(c < ansiEscapesLimit && ansiEscapes[c])
+										outAnsiEscape(c, out);
+									else
+										outOctalEscape(c, 077 < c || ({
+												//  Peak at the next code point.  If it's not a
+												// valid octal digit, print less than 3 digits.
+												wint_t nextc;
+												ungetWideChar(&d, (nextc = getLocaleChar(&d, singleByte)));
+												//  It is technically true that this comparison is
+												// inappropriate when ! defined(__STDC_ISO_10646__)...
+												// but it most likely holds up even then.
+												L'7' >= nextc && L'0' <= nextc;
+											}), out
+										);
+								else if(! useUnicodeEscapes) {
+									unsigned cbuff[7];
+								#if 1
+									unsigned * cbuffPtr;
+									cbuff[6] = 0;
+									cbuff[5] = (c & 0xBF) | 0x80;
+									if(0x800 > c)
+										*(cbuffPtr = cbuff + 4) = 0xC0 | c >> 6;
+									else {
+										cbuff[4] = (c >> 6 & 0xBF) | 0x80;
+										if(0x10000 > c)
+											*(cbuffPtr = cbuff + 3) = 0xE0 | c >> 12;
+										else {
+											cbuff[3] = (c >> 12 & 0xBF) | 0x80;
+											if(0x200000 > c)
+												*(cbuffPtr = cbuff + 2) = 0xF0 | c >> 18;
+											else {
+												cbuff[2] = (c >> 18 & 0xBF) | 0x80;
+												if(0x4000000 > c)
+													*(cbuffPtr = cbuff + 1) = 0xF8 | c >> 24;
+												else {
+													cbuff[1] = (c >> 24 & 0xBF) | 0x80;
+													*(cbuffPtr = cbuff) = 0xFC | (c >= 0x40000000);
+												}
+											}
+										}
+									}
+								#else
+									unsigned * cbuffPtr = cbuff;
+									if(0x800 > c) {
+										*cbuff = 0xC0 | c >> 6;
+										cbuff[1] = (c & 0xBF) | 0x80;
+										cbuff[2] = 0;
+									}
+									else if(0x10000 > c) {
+										*cbuff = 0xE0 | c >> 12;
+										cbuff[1] = (c >> 6 & 0xBF) | 0x80;
+										cbuff[2] = (c & 0x3F) | 0x80;
+										cbuff[3] = 0;
+									}
+									else if(0x200000 > c) {
+										*cbuff = 0xF0 | c >> 18;
+										cbuff[1] = (c >> 12 & 0xBF) | 0x80;
+										cbuff[2] = (c >> 6 & 0xBF) | 0x80;
+										cbuff[3] = (c & 0xBF) | 0x80;
+										cbuff[4] = 0;
+									}
+									else if(0x4000000 > c) {
+										*cbuff = 0xF8 | c >> 24;
+										cbuff[1] = (c >> 18 & 0xBF) | 0x80;
+										cbuff[2] = (c >> 12 & 0xBF) | 0x80;
+										cbuff[3] = (c >> 6 & 0xBF) | 0x80;
+										cbuff[4] = (c & 0xBF) | 0x80;
+										cbuff[5] = 0;
+									}
+									else {
+										*cbuff = 0xFC | (c >= 0x40000000);
+										cbuff[1] = (c >> 24 & 0xBF) | 0x80;
+										cbuff[2] = (c >> 18 & 0xBF) | 0x80;
+										cbuff[3] = (c >> 12 & 0xBF) | 0x80;
+										cbuff[4] = (c >> 6 & 0xBF) | 0x80;
+										cbuff[5] = (c & 0xBF) | 0x80;
+										cbuff[6] = 0;
+									}
+								#endif
+									do
+										outOctalEscape(*cbuffPtr, 1, out);
+									while(*(++cbuffPtr));
+								}
+								else if(sizeof(wchar_t) > 2)
+									if(65535 >= c)
+										outHexEscape('u', c, 0xFFF < c || ({
+												wint_t nextc;
+												ungetWideChar(&d, (nextc = getLocaleChar(&d, singleByte)));
+												iswxdigit(nextc);
+											}) ? 4 : 1, out
+										);
+									else {
+										//  In hopes of it taking less output glyphs,
+										// only output as many UTF digits as are needed.
+										// Terminate the quoting if it is followed by a
+										// character that would be interpreted as a hex digit.
+										outHexEscape('U', c, 1, out);
+										wint_t nextc;
+										ungetWideChar(&d, (nextc = getLocaleChar(&d, singleByte)));
+										if(iswxdigit(nextc))
+											break;
+									}
+								else
+									outHexEscape('u', c, 0xFFF < c || ({
+											wint_t nextc;
+											ungetWideChar(&d, (nextc = getLocaleChar(&d, singleByte)));
+											iswxdigit(nextc);
+										}) ? 4 : 1, out
+									);
+							}
+							while(0 != (c = getLocaleChar(&d, singleByte)) && WEOF != c && ({
+								isPrintable = printableClass <= codePointClass(c);
+								1;
+							}));
+						}
+						outCloseQuote(quoteStart, out);
+						L'\'' == c;
+					}))
+						outPuts("\\\'", out);
+					else if(0 == c || WEOF == c)
+						break;
+				}
+				else {
+					outWrite(d.cbuff, d.bytesInChar, out);
+					if(singleByte)
+						copySafeBytes(&d, out, disableCQuoting ? 0 : printableClass);
+				}
+				c = getLocaleChar(&d, singleByte);
+			} while(0 != c && WEOF != c);
+		}
+		else {
+			outPuts("''", out);
+			undecodable = d.error;
+		}
+	} while(outEndString((0 != c || ! ignoreNullInput) && ! undecodable, in, out), 0 == c ? (
+			//  The terminator of a string from null terminated input does not depend on what
+			// follows it, so it is written before the next character is read.  Output that is
+			// flushed while that read waits then ends with a complete string.
+			(ignoreNullInput || ! nullTerminatedOutput || (EOF != outPutc(0, out) &&
+				(! flushArguments || EOF != outFlush(out)))) && WEOF != (c = getLocaleChar(&d, singleByte)) ? ({
+				unsigned lc = ignoreNullInput || nullTerminatedOutput || EOF != outPutc(' ', out);
+				if(L'~' == c && lc) {
+					isPrintable = 1;
+					goto wideCharStartEscape;
+				}
+				lc;
+			}) : ({
+				if(ignoreNullInput && nullTerminatedOutput)
+					outPutc(0, out);
+				0;
+			})
+		) : ({
+			if(ignoreNullInput && nullTerminatedOutput)
+				outPutc(0, out);
+			0;
+		})
+	);
+	return d.error;
+}
+
+static inline __attribute__((always_inline)) int escapeByteKernel(unsigned variant, unsigned flags,
+	printfq_input * in, printfq_output * out)
+{
+	return escapeWideKernel(variant | VARIANT_SINGLE_BYTE, flags, in, out);
+}
+
+//  The locale uses UTF-8 encoding
+static inline __attribute__((always_inline)) int escapeUtf8Kernel(unsigned variant, unsigned flags,
+	printfq_input * in, printfq_output * out)
+{
+	const unsigned printableClass = minimumClass(variant);
+	const unsigned useUnicodeEscapes = variant & PRINTFQ_UNICODE_ESCAPES;
+	const unsigned flushArguments = flags & PRINTFQ_FLUSH_ARGUMENTS;
+	const unsigned ignoreNullInput = flags & PRINTFQ_IGNORE_NULL_INPUT;
+	const unsigned nullTerminatedOutput = flags & PRINTFQ_NULL_TERMINATED_OUTPUT;
+	const unsigned ansiEscapesLimit = useUnicodeEscapes ? sizeof(ansiEscapes) : 14;
+	struct utf8Decoder d = {.in = in};
+	int32_t c = getUtf8CodePoint(&d);
+	unsigned isPrintable;
+	size_t quoteStart;
+	if('~' == c) {
+		isPrintable = 1;
+		goto utf8StartEscape;
+	}
+	do {
+		if(0 < c) {
+			do {
+				//  Except when c <= 0, which has been ruled out, c will always be > 127
+				// when bytesInCodePoint is 0
+				if(! (isPrintable = d.bytesInCodePoint && printableClass <= utf8CodePointClass((wint_t)c))
+					|| ((uint32_t)c < sizeof(shControlChars) && shControlChars[c])
+				) {
+					if('\'' == c)
+						outPuts("\\\'", out);
+					else {
+						utf8StartEscape:
+						quoteStart = outCount(out);
+						outPuts("$'", out);
+						do {
+							if(isPrintable)
+								if('\\' == c)
+									outPuts("\\\\", out);
+								else if('\'' == c)
+									outPuts("\\'", out);
+								else if(d.bytesInCodePoint)
+									outWrite(d.cbuff, d.bytesInCodePoint, out);
+								else
+									outPutc(c, out);
+							//  c will be in the range of 128 - 255 when ! bytesInCodePoint,
+							// but there are valid code points in that range too
+							else if(128 > c || ! d.bytesInCodePoint) {
+								out->stats.invalidBytes += ! d.bytesInCodePoint;
+								if((uint32_t)c < ansiEscapesLimit && ansiEscapes[c])
+									outAnsiEscape(c, out);
+								else
+									outOctalEscape(c, 077 < c || ({
+											//  Peak at the next code point.  If it's not a
+											// valid octal digit, print less than 3 digits.
+											//  Only ASCII is compared against here and in
+											// the hex digit comparisons below, so peeking at
+											// the next byte is equivalent to decoding it.
+											int nextc = inPeek(in);
+											'7' >= nextc && '0' <= nextc;
+										}), out
+									);
+							}
+							else if(! useUnicodeEscapes)
+								//  Optimization is not possible in this case
+								// since all bytes are > 127
+								for(unsigned idx = 0; idx < d.bytesInCodePoint; idx++)
+									outOctalEscape(d.cbuff[idx], 1, out);
+							else if(65535 >= c)
+								outHexEscape('u', c, 0xFFF < c || ({
+										int nextc = inPeek(in);
+										nextc <= 'f' && isxdigit(nextc);
+									}) ? 4 : 1, out
+								);
+							else {
+								//  In hopes of it taking less output glyphs,
+								// only output as many UTF digits as are needed.
+								// Terminate the quoting if it is followed by a
+								// character that would be interpreted as a hex digit.
+								outHexEscape('U', c, 1, out);
+								int nextc = inPeek(in);
+								if(nextc <= 'f' && isxdigit(nextc))
+									break;
+							}
+						}
+						while(0 < (c = getUtf8CodePoint(&d)) && ({
+							isPrintable = d.bytesInCodePoint && printableClass <= utf8CodePointClass((wint_t)c);
+							1;
+						}));
+						outCloseQuote(quoteStart, out);
+						if(0 >= c)
+							break;
+					}
+				}
+				else {
+					outWrite(d.cbuff, d.bytesInCodePoint, out);
+					copySafeUtf8(in, out, printableClass);
+				}
+				c = getUtf8CodePoint(&d);
+			}
+			while(0 < c);
+		}
+		else
+			outPuts("''", out);
+	} while(outEndString(0 != c || ! ignoreNullInput, in, out), 0 == c ? (
+			//  The terminator of a string from null terminated input does not depend on what
+			// follows it, so it is written before the next character is read.  Output that is
+			// flushed while that read waits then ends with a complete string.
+			(ignoreNullInput || ! nullTerminatedOutput || (EOF != outPutc(0, out) &&
+				(! flushArguments || EOF != outFlush(out)))) && EOF != (c = getUtf8CodePoint(&d)) ? ({
+				unsigned lc = ignoreNullInput || nullTerminatedOutput || EOF != outPutc(' ', out);
+				if('~' == c && lc) {
+					isPrintable = 1;
+					goto utf8StartEscape;
+				}
+				lc;
+			}) : ({
+				if(ignoreNullInput && nullTerminatedOutput)
+					outPutc(0, out);
+				0;
+			})
+		) : ({
+			if(ignoreNullInput && nullTerminatedOutput)
+				outPutc(0, out);
+			0;
+		})
+	);
+	return 0;
+}
+
+int printfq_opts_init(printfq_opts * opts, unsigned flags)
+{
+	const char * currentLocale = nl_langinfo(CODESET);
+	const struct classTable * t = __atomic_load_n(&classes, __ATOMIC_ACQUIRE);
+	//  The bitmap for the new character set is selected when it is first needed
+	if(t && strcmp(currentLocale, t->codeset))
+		__atomic_store_n(&classes, NULL, __ATOMIC_RELEASE);
+	opts->flags = flags;
+	opts->charset = ! strcmp("UTF-8", currentLocale) ? PRINTFQ_CHARSET_UTF8 :
+		! strcmp("ANSI_X3.4-1968", currentLocale) ? PRINTFQ_CHARSET_ASCII :
+		1 == MB_CUR_MAX ? PRINTFQ_CHARSET_SINGLE_BYTE : PRINTFQ_CHARSET_LOCALE;
+	return 0;
+}
+
+//  --optimize-output-length.  Each string is split into runs of bare output, '' quoting, and $''
+// quoting, with the split chosen by dynamic programming to minimize the length of the output.
+// Bare special characters are escaped with a backslash.  The cost of each character in each
+// state, and of each change of state, is known from the character alone, except that the short
+// forms of octal and hex escapes depend on whether the next character is a digit inside the same
+// $'' quoting.  That is charged as part of the change between consecutive characters.
+//  Memory is bounded by a window of characters.  Whenever the window fills, the paths to the
+// cheapest way of reaching each state for the newest character are traced back to where they
+// converge, and everything before that point is final and output.  When they do not converge
+// within the window, the path of the cheapest state is taken, which may cost a few bytes over
+// the optimum per window.  This is not supported by the wide or byte engines.
+#define OPT_BARE   0
+#define OPT_SINGLE 1
+#define OPT_ANSI   2
+#define OPT_INFINITE 0xFF
+#define OPT_WINDOW 4096
+
+#define OPT_PRINTABLE 0x01
+#define OPT_BYTE      0x02 // escaped as a single byte
+#define OPT_SPECIAL   0x04 // escaped with a backslash when bare
+#define OPT_OCTAL     0x08 // the short escape is invalid before an octal digit
+#define OPT_HEX       0x10 // the short escape is invalid before a hex digit
+
+struct optUnit {
+	int32_t c;
+	unsigned char bytes[4];
+	unsigned char size;
+	unsigned char flags;
+	unsigned char cost[3];
+	unsigned char longCost;
+	unsigned char back[3];
+};
+
+struct optimizer {
+	struct optUnit units[OPT_WINDOW];
+	unsigned char path[OPT_WINDOW];
+	//  Units base through next - 1 are in the window, indexed modulo OPT_WINDOW
+	size_t base;
+	size_t next;
+	uint64_t cost[3];
+	//  The state of the last unit output, or OPT_BARE at the start of a string
+	unsigned state;
+	size_t quoteStart;
+	unsigned flags;
+	unsigned printableClass;
+	unsigned ansiEscapesLimit;
+};
+
+//  The cost of changing from one state to another
+static const unsigned char optTransition[3][3] = {
+	{0, 1, 2}, // from bare:  ' or $'
+	{1, 0, 3}, // from '':  ' or '$'
+	{1, 2, 0}  // from $'':  ' or ''
+};
+
+static unsigned hexDigitCount(uint32_t c)
+{
+	unsigned n = 1;
+	while(c >>= 4)
+		n++;
+	return n;
+}
+
+//  Fill in the costs of a unit, which has c, bytes, size, and OPT_PRINTABLE and OPT_BYTE set
+static void optClassify(struct optimizer * o, struct optUnit * u, unsigned first)
+{
+	const unsigned minimal = o->flags & PRINTFQ_MINIMAL;
+	const int32_t c = u->c;
+	unsigned char * cost = u->cost;
+	if(u->flags & OPT_BYTE && 128 > c && (shControlChars[c] || ('~' == c && first)))
+		u->flags |= OPT_SPECIAL;
+	//  Newlines cannot be escaped with a backslash
+	cost[OPT_BARE] = ! (u->flags & OPT_PRINTABLE) ? OPT_INFINITE :
+		u->flags & OPT_SPECIAL ? '\n' == c ? OPT_INFINITE : 2 : u->size;
+	cost[OPT_SINGLE] = '\'' == c || ! (u->flags & OPT_PRINTABLE) ? OPT_INFINITE : u->size;
+	u->longCost = cost[OPT_ANSI] = minimal ? OPT_INFINITE :
+		u->flags & OPT_PRINTABLE ? '\'' == c || '\\' == c ? 2 : u->size :
+		u->flags & OPT_BYTE ? (uint32_t)c < o->ansiEscapesLimit && ansiEscapes[c] ? 2 :
+			077 < c ? 4 : 07 < c ? 3 : 2 :
+		! (o->flags & PRINTFQ_UNICODE_ESCAPES) ? 4 * u->size :
+		0xFFF < c && 0xFFFF >= c ? 6 : 2 + hexDigitCount(c);
+	if(cost[OPT_ANSI] != OPT_INFINITE && ! (u->flags & OPT_PRINTABLE)) {
+		if(u->flags & OPT_BYTE) {
+			if(4 > cost[OPT_ANSI] && ! ((uint32_t)c < o->ansiEscapesLimit && ansiEscapes[c])) {
+				u->flags |= OPT_OCTAL;
+				u->longCost = 4;
+			}
+		}
+		else if(o->flags & PRINTFQ_UNICODE_ESCAPES && 0xFFF >= c) {
+			u->flags |= OPT_HEX;
+			u->longCost = 6;
+		}
+		else if(o->flags & PRINTFQ_UNICODE_ESCAPES && 0xFFFF < c) {
+			u->flags |= OPT_HEX;
+			u->longCost = 10;
+		}
+	}
+}
+
+//  Whether the short escape of u cannot be followed by next inside the same $''
+static int optNeedsLongEscape(const struct optUnit * u, const struct optUnit * next)
+{
+	return next->flags & OPT_PRINTABLE && next->flags & OPT_BYTE && (
+		(u->flags & OPT_OCTAL && '0' <= next->c && '7' >= next->c) ||
+		(u->flags & OPT_HEX && 128 > next->c && isxdigit(next->c)));
+}
+
+static void optOutputUnit(const struct optimizer * o, const struct optUnit * u, unsigned state,
+	const struct optUnit * next, unsigned nextState, printfq_output * out)
+{
+	if(OPT_ANSI != state) {
+		if(OPT_BARE == state && u->flags & OPT_SPECIAL)
+			outPutc('\\', out);
+		outWrite(u->bytes, u->size, out);
+		return;
+	}
+	unsigned useLong = next && OPT_ANSI == nextState && optNeedsLongEscape(u, next);
+	if(u->flags & OPT_PRINTABLE)
+		if('\\' == u->c)
+			outPuts("\\\\", out);
+		else if('\'' == u->c)
+			outPuts("\\'", out);
+		else
+			outWrite(u->bytes, u->size, out);
+	else if(u->flags & OPT_BYTE)
+		if((uint32_t)u->c < o->ansiEscapesLimit && ansiEscapes[u->c])
+			outAnsiEscape(u->c, out);
+		else
+			outOctalEscape(u->c, 077 < u->c || useLong, out);
+	else if(! (o->flags & PRINTFQ_UNICODE_ESCAPES))
+		for(unsigned idx = 0; idx < u->size; idx++)
+			outOctalEscape(u->bytes[idx], 1, out);
+	else if(0xFFFF >= u->c)
+		outHexEscape('u', u->c, 0xFFF < u->c || useLong ? 4 : 1, out);
+	else
+		outHexEscape('U', u->c, useLong ? 8 : 1, out);
+}
+
+static void optChangeState(struct optimizer * o, unsigned state, printfq_output * out)
+{
+	if(state != o->state) {
+		if(OPT_BARE != o->state)
+			outCloseQuote(o->quoteStart, out);
+		if(OPT_BARE != state) {
+			o->quoteStart = outCount(out);
+			outPuts(OPT_SINGLE == state ? "'" : "$'", out);
+		}
+		o->state = state;
+	}
+}
+
+//  Output the units from base up to, but not including, last, given that last is in the given
+// state.  last becomes the new base.
+static void optOutput(struct optimizer * o, size_t last, unsigned state, printfq_output * out)
+{
+	for(size_t idx = last; idx > o->base; idx--)
+		state = o->path[(idx - 1) % OPT_WINDOW] = o->units[idx % OPT_WINDOW].back[state];
+	for(size_t idx = o->base; idx < last; idx++) {
+		const struct optUnit * u = o->units + idx % OPT_WINDOW;
+		unsigned uState = o->path[idx % OPT_WINDOW];
+		unsigned nextState = idx + 1 < last ? o->path[(idx + 1) % OPT_WINDOW] : state;
+		optChangeState(o, uState, out);
+		optOutputUnit(o, u, uState, o->units + (idx + 1) % OPT_WINDOW, nextState, out);
+	}
+	o->base = last;
+}
+
+//  Called when the window is full
+static void optCommit(struct optimizer * o, printfq_output * out)
+{
+	size_t idx = o->next - 1;
+	unsigned mask = 0;
+	for(unsigned q = 0; q < 3; q++)
+		if(UINT64_MAX != o->cost[q])
+			mask |= 1 << q;
+	//  Trace all of the current paths back until they converge
+	while(idx > o->base && (mask & (mask - 1))) {
+		unsigned prev = 0;
+		for(unsigned q = 0; q < 3; q++)
+			if(mask & 1 << q)
+				prev |= 1 << o->units[idx % OPT_WINDOW].back[q];
+		mask = prev;
+		idx--;
+	}
+	if(idx > o->base && ! (mask & (mask - 1)))
+		optOutput(o, idx, __builtin_ctz(mask), out);
+	else {
+		//  Settle on the cheapest path so far
+		unsigned best = 0;
+		for(unsigned q = 1; q < 3; q++)
+			if(o->cost[q] < o->cost[best])
+				best = q;
+		for(unsigned q = 0; q < 3; q++)
+			if(q != best)
+				o->cost[q] = UINT64_MAX;
+		optOutput(o, o->next - 1, best, out);
+	}
+}
+
+static void optAdd(struct optimizer * o, struct optUnit * u, printfq_output * out)
+{
+	const struct optUnit * prev = o->next > o->base ? o->units + (o->next - 1) % OPT_WINDOW : NULL;
+	uint64_t cost[3];
+	for(unsigned q = 0; q < 3; q++) {
+		cost[q] = UINT64_MAX;
+		u->back[q] = 0;
+		if(OPT_INFINITE == u->cost[q])
+			continue;
+		for(unsigned p = 0; p < 3; p++) {
+			if(UINT64_MAX == o->cost[p])
+				continue;
+			uint64_t v = o->cost[p] + optTransition[p][q] + u->cost[q];
+			if(OPT_ANSI == p && OPT_ANSI == q && prev && optNeedsLongEscape(prev, u))
+				v += prev->longCost - prev->cost[OPT_ANSI];
+			if(v < cost[q]) {
+				cost[q] = v;
+				u->back[q] = p;
+			}
+		}
+	}
+	memcpy(o->cost, cost, sizeof(cost));
+	o->next++;
+	if(OPT_WINDOW == o->next - o->base)
+		optCommit(o, out);
+}
+
+//  Output whatever remains of a string, ending its quoting
+static void optFinish(struct optimizer * o, printfq_output * out)
+{
+	if(o->next == o->base) {
+		outPuts("''", out);
+		return;
+	}
+	unsigned best = 0;
+	uint64_t bestCost = UINT64_MAX;
+	for(unsigned q = 0; q < 3; q++)
+		if(UINT64_MAX != o->cost[q] && o->cost[q] + (OPT_BARE != q) < bestCost) {
+			bestCost = o->cost[q] + (OPT_BARE != q);
+			best = q;
+		}
+	size_t last = o->next - 1;
+	optOutput(o, last, best, out);
+	optChangeState(o, best, out);
+	optOutputUnit(o, o->units + last % OPT_WINDOW, best, NULL, 0, out);
+	optChangeState(o, OPT_BARE, out);
+}
+
+//  Read the next character into u, decoding UTF-8 if d is set.  Returns 1, or 0 or EOF at the
+// end of a string.
+static int optGetUnit(const struct optimizer * o, printfq_input * in, struct utf8Decoder * d,
+	struct optUnit * u)
+{
+	int32_t c = d ? getUtf8CodePoint(d) : inGetc(in);
+	if(0 >= c)
+		return c;
+	u->c = c;
+	if(! d) {
+		u->size = 1;
+		*u->bytes = c;
+		u->flags = OPT_BYTE | (o->flags & PRINTFQ_MINIMAL || isprint(c) ? OPT_PRINTABLE : 0);
+	}
+	else if(d->bytesInCodePoint) {
+		u->size = d->bytesInCodePoint;
+		memcpy(u->bytes, d->cbuff, u->size);
+		u->flags = (1 == u->size ? OPT_BYTE : 0) |
+			(o->printableClass <= utf8CodePointClass((wint_t)c) ? OPT_PRINTABLE : 0);
+	}
+	else {
+		u->size = 1;
+		*u->bytes = c;
+		u->flags = OPT_BYTE;
+	}
+	return 1;
+}
+
+static int escapeOptimized(const printfq_opts * opts, printfq_input * in, printfq_output * out)
+{
+	const unsigned flushArguments = opts->flags & PRINTFQ_FLUSH_ARGUMENTS;
+	const unsigned ignoreNullInput = opts->flags & PRINTFQ_IGNORE_NULL_INPUT;
+	const unsigned nullTerminatedOutput = opts->flags & PRINTFQ_NULL_TERMINATED_OUTPUT;
+	struct optimizer * o = malloc(sizeof(*o));
+	if(! o)
+		return ENOMEM;
+	o->flags = opts->flags;
+	o->printableClass = minimumClass(opts->flags);
+	o->ansiEscapesLimit = opts->flags & PRINTFQ_UNICODE_ESCAPES ? sizeof(ansiEscapes) : 14;
+	struct utf8Decoder d = {.in = in};
+	struct utf8Decoder * decoder = PRINTFQ_CHARSET_UTF8 == opts->charset &&
+		! (opts->flags & PRINTFQ_MINIMAL) ? &d : NULL;
+	int c;
+	do {
+		o->base = o->next = 0;
+		o->cost[OPT_BARE] = 0;
+		o->cost[OPT_SINGLE] = o->cost[OPT_ANSI] = UINT64_MAX;
+		o->state = OPT_BARE;
+		struct optUnit * u;
+		while(1 == (c = optGetUnit(o, in, decoder, u = o->units + o->next % OPT_WINDOW))) {
+			out->stats.invalidBytes += decoder && ! d.bytesInCodePoint;
+			optClassify(o, u, ! o->next);
+			optAdd(o, u, out);
+		}
+		optFinish(o, out);
+		outEndString(0 != c || ! ignoreNullInput, in, out);
+		if(c) {
+			if(ignoreNullInput && nullTerminatedOutput)
+				outPutc(0, out);
+			break;
+		}
+		//  As in the engines, the terminator is written before the next character is read
+		if(! ignoreNullInput && nullTerminatedOutput && EOF != outPutc(0, out) && flushArguments)
+			outFlush(out);
+		if(EOF == inPeek(in)) {
+			if(ignoreNullInput && nullTerminatedOutput)
+				outPutc(0, out);
+			break;
+		}
+		if(! ignoreNullInput && ! nullTerminatedOutput)
+			outPutc(' ', out);
+	} while(! out->error);
+	free(o);
+	return 0;
+}
+
+//  Each engine is compiled separately for each combination of the options that are tested
+// inside its loops, so that those tests are resolved at compile time.  A variant index has a bit
+// for each of -u and -m, and the -i/-e printable class above them.
+#define VARIANT_UNICODE_ESCAPES 1
+#define VARIANT_MINIMAL 2
+#define VARIANT_FLAGS(i) (((i) & VARIANT_UNICODE_ESCAPES ? PRINTFQ_UNICODE_ESCAPES : 0) | \
+	((i) & VARIANT_MINIMAL ? PRINTFQ_MINIMAL : 0) | \
+	((i) >> 2 == 2 ? PRINTFQ_ESCAPE_MORE : (i) >> 2 == 1 ? PRINTFQ_ESCAPE_INVISIBLE : 0))
+#define VARIANT_COUNT 12
+
+typedef int (* engineVariant)(unsigned flags, printfq_input * in, printfq_output * out);
+
+#define ENGINE_VARIANT(engine, i) \
+	static int engine##i(unsigned flags, printfq_input * in, printfq_output * out) \
+	{ \
+		return engine##Kernel(VARIANT_FLAGS(i), flags, in, out); \
+	}
+
+//  The narrow engine ignores the printable class, -m makes both the class and -u irrelevant
+// since they only apply with $'' quoting, and the UTF-8 engine is not used with -m.
+ENGINE_VARIANT(escapeNarrow, 0) ENGINE_VARIANT(escapeNarrow, 1) ENGINE_VARIANT(escapeNarrow, 2)
+ENGINE_VARIANT(escapeUtf8, 0) ENGINE_VARIANT(escapeUtf8, 1)
+ENGINE_VARIANT(escapeUtf8, 4) ENGINE_VARIANT(escapeUtf8, 5)
+ENGINE_VARIANT(escapeUtf8, 8) ENGINE_VARIANT(escapeUtf8, 9)
+ENGINE_VARIANT(escapeWide, 0) ENGINE_VARIANT(escapeWide, 1) ENGINE_VARIANT(escapeWide, 2)
+ENGINE_VARIANT(escapeWide, 4) ENGINE_VARIANT(escapeWide, 5)
+ENGINE_VARIANT(escapeWide, 8) ENGINE_VARIANT(escapeWide, 9)
+ENGINE_VARIANT(escapeByte, 0) ENGINE_VARIANT(escapeByte, 1) ENGINE_VARIANT(escapeByte, 2)
+ENGINE_VARIANT(escapeByte, 4) ENGINE_VARIANT(escapeByte, 5)
+ENGINE_VARIANT(escapeByte, 8) ENGINE_VARIANT(escapeByte, 9)
+
+static const engineVariant narrowVariants[VARIANT_COUNT] = {
+	escapeNarrow0, escapeNarrow1, escapeNarrow2, escapeNarrow2,
+	escapeNarrow0, escapeNarrow1, escapeNarrow2, escapeNarrow2,
+	escapeNarrow0, escapeNarrow1, escapeNarrow2, escapeNarrow2
+};
+static const engineVariant utf8Variants[VARIANT_COUNT] = {
+	[0] = escapeUtf80, [1] = escapeUtf81,
+	[4] = escapeUtf84, [5] = escapeUtf85,
+	[8] = escapeUtf88, [9] = escapeUtf89
+};
+static const engineVariant wideVariants[VARIANT_COUNT] = {
+	escapeWide0, escapeWide1, escapeWide2, escapeWide2,
+	escapeWide4, escapeWide5, escapeWide2, escapeWide2,
+	escapeWide8, escapeWide9, escapeWide2, escapeWide2
+};
+static const engineVariant byteVariants[VARIANT_COUNT] = {
+	escapeByte0, escapeByte1, escapeByte2, escapeByte2,
+	escapeByte4, escapeByte5, escapeByte2, escapeByte2,
+	escapeByte8, escapeByte9, escapeByte2, escapeByte2
+};
+
+static unsigned variantIndex(unsigned flags)
+{
+	return (flags & PRINTFQ_UNICODE_ESCAPES ? VARIANT_UNICODE_ESCAPES : 0) |
+		(flags & PRINTFQ_MINIMAL ? VARIANT_MINIMAL : 0) |
+		(flags & PRINTFQ_ESCAPE_MORE ? 2 << 2 : flags & PRINTFQ_ESCAPE_INVISIBLE ? 1 << 2 : 0);
+}
+
+int printfq_escape_stream(const printfq_opts * opts, printfq_input * in, printfq_output * out)
+{
+	TRACE_BEGIN(out);
+	//  The byte engine falls back to the wide engine if its table cannot be allocated, after which
+	// the engine is sure to find the table
+	const engineVariant * variants = PRINTFQ_CHARSET_ASCII == opts->charset ||
+		(PRINTFQ_CHARSET_UTF8 == opts->charset && opts->flags & PRINTFQ_MINIMAL) ? narrowVariants :
+		PRINTFQ_CHARSET_UTF8 == opts->charset ? utf8Variants :
+		PRINTFQ_CHARSET_SINGLE_BYTE == opts->charset && FAST_PATHS && localeBytes() ? byteVariants :
+		wideVariants;
+	int rc = opts->flags & PRINTFQ_OPTIMIZE_OUTPUT_LENGTH &&
+		(PRINTFQ_CHARSET_ASCII == opts->charset || PRINTFQ_CHARSET_UTF8 == opts->charset) ?
+		escapeOptimized(opts, in, out) : variants[variantIndex(opts->flags)](opts->flags, in, out);
+	if(out->pos != out->buf)
+		outFlush(out);
+	TRACE_END();
+	if(! rc && ! (rc = in->error))
+		rc = out->error;
+	if(rc) {
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+//  Output to a fixed size buffer.  Output that does not fit is counted and discarded.
+struct fixedOutput {
+	printfq_output out;
+	size_t length;
+	char scratch[256];
+};
+
+//  Count large blocks without copying them into the scratch buffer
+static int fixedOutputCount(printfq_output * out, const void * ptr, size_t size)
+{
+	struct fixedOutput * fixed = (struct fixedOutput *)out;
+	fixed->length += (out->pos - out->buf) + size;
+	out->pos = out->buf;
+	return 0;
+}
+
+static int fixedOutputFlush(printfq_output * out)
+{
+	struct fixedOutput * fixed = (struct fixedOutput *)out;
+	if(out->buf != fixed->scratch) {
+		//  Keep writing to the destination until it is full
+		if(out->pos != out->end)
+			return 0;
+		fixed->length = out->pos - out->buf;
+	}
+	else
+		fixed->length += out->pos - out->buf;
+	out->buf = out->pos = fixed->scratch;
+	out->end = fixed->scratch + sizeof(fixed->scratch);
+	out->write = fixedOutputCount;
+	return 0;
+}
+
+typedef int (* streamFunction)(const printfq_opts * opts, printfq_input * in, printfq_output * out);
+
+static size_t fixedStream(streamFunction stream, const char * in, size_t len, char * out, size_t cap,
+	const printfq_opts * opts)
+{
+	printfq_input input = {
+		.pos = (const unsigned char *)in,
+		.end = (const unsigned char *)in + len
+	};
+	struct fixedOutput output = {.out = {
+		.buf = out,
+		.pos = out,
+		.end = out + cap,
+		.flush = fixedOutputFlush
+	}};
+	if(! cap)
+		fixedOutputFlush(&output.out);
+	if(stream(opts, &input, &output.out))
+		return (size_t)-1;
+	return output.length + (output.out.pos - output.out.buf);
+}
+
+size_t printfq_escape(const char * in, size_t len, char * out, size_t cap, const printfq_opts * opts)
+{
+	return fixedStream(printfq_escape_stream, in, len, out, cap, opts);
+}
+
+size_t printfq_escaped_length(const char * in, size_t len, const printfq_opts * opts)
+{
+	return printfq_escape(in, len, NULL, 0, opts);
+}
+
+//  --decode.  The input is split into words at unquoted spaces, tabs, newlines, and null
+// characters, as a shell would split printfq's output, and each word is output with a null
+// terminator.  Only the quoting and escapes that printfq emits are accepted.  Any other byte that
+// a shell would interpret, such as a bare $ or a tilde at the start of a word, is an error.  In
+// a PRINTFQ_CHARSET_LOCALE character set, multibyte characters are copied whole since their
+// trailing bytes may look like a backslash or a quote.
+static inline int isDecodeDelimiter(int c)
+{
+	return ' ' == c || '\t' == c || '\n' == c || 0 == c;
+}
+
+//  Copy the byte c, and the rest of the character that it starts
+static int decodeCopyChar(unsigned multibyte, int c, printfq_input * in, printfq_output * out)
+{
+	if(multibyte && 0x80 <= c) {
+		mbstate_t state = {0};
+		char byte = c;
+		while((size_t)-2 == mbrtowc(NULL, &byte, 1, &state)) {
+			outPutc(byte, out);
+			if(EOF == (c = inGetc(in)))
+				return EILSEQ;
+			byte = c;
+		}
+	}
+	return EOF == outPutc(c, out) ? out->error : 0;
+}
+
+//  '' quoting, after the opening quote
+static int decodeQuoted(printfq_input * in, printfq_output * out)
+{
+	int c;
+	if(FAST_PATHS)
+		while(in->pos < in->end || inRefill(in)) {
+			const unsigned char * quote = memchr(in->pos, '\'', in->end - in->pos);
+			const unsigned char * stop = quote ? quote : in->end;
+			outWrite(in->pos, stop - in->pos, out);
+			if((in->pos = stop) == quote) {
+				in->pos++;
+				return 0;
+			}
+		}
+	else
+		while(EOF != (c = inGetc(in)))
+			if('\'' == c)
+				return 0;
+			else
+				outPutc(c, out);
+	return EILSEQ;
+}
+
+//  Output code point c in the character set of opts
+static int decodeCodePoint(const printfq_opts * opts, uint32_t c, printfq_output * out)
+{
+	char buff[MB_LEN_MAX > 4 ? MB_LEN_MAX : 4];
+	size_t size;
+	if(0x110000 <= c || (0xD800 <= c && 0xDFFF >= c))
+		return EILSEQ;
+	if(PRINTFQ_CHARSET_LOCALE <= opts->charset) {
+		mbstate_t state = {0};
+		if((size_t)-1 == (size = wcrtomb(buff, c, &state)))
+			return EILSEQ;
+	}
+	else if(0x80 > c)
+		buff[(size = 1) - 1] = c;
+	else if(0x800 > c) {
+		buff[0] = 0xC0 | c >> 6;
+		buff[(size = 2) - 1] = 0x80 | (c & 0x3F);
+	}
+	else if(0x10000 > c) {
+		buff[0] = 0xE0 | c >> 12;
+		buff[1] = 0x80 | (c >> 6 & 0x3F);
+		buff[(size = 3) - 1] = 0x80 | (c & 0x3F);
+	}
+	else {
+		buff[0] = 0xF0 | c >> 18;
+		buff[1] = 0x80 | (c >> 12 & 0x3F);
+		buff[2] = 0x80 | (c >> 6 & 0x3F);
+		buff[(size = 4) - 1] = 0x80 | (c & 0x3F);
+	}
+	return outWrite(buff, size, out) ? out->error : 0;
+}
+
+//  Read up to maxDigits digits in the given base into *value.  Returns the number read.
+static unsigned decodeDigits(printfq_input * in, unsigned base, unsigned maxDigits, uint32_t * value)
+{
+	unsigned count = 0;
+	for(int c; count < maxDigits && EOF != (c = inPeek(in)); count++) {
+		unsigned digit = '0' <= c && '9' >= c ? (unsigned)c - '0' :
+			'a' <= (c | 0x20) && 'f' >= (c | 0x20) ? (unsigned)(c | 0x20) - 'a' + 10 : base;
+		if(digit >= base)
+			break;
+		*value = *value * base + digit;
+		in->pos++;
+	}
+	return count;
+}
+
+//  $'' quoting, after the opening quote
+static int decodeAnsiQuoted(const printfq_opts * opts, printfq_input * in, printfq_output * out)
+{
+	const unsigned multibyte = PRINTFQ_CHARSET_LOCALE == opts->charset;
+	for(;;) {
+		if(FAST_PATHS && ! multibyte && in->pos < in->end) {
+			const unsigned char * s = in->pos;
+			while(s < in->end && '\\' != *s && '\'' != *s)
+				s++;
+			outWrite(in->pos, s - in->pos, out);
+			in->pos = s;
+		}
+		int c = inGetc(in);
+		uint32_t value = 0;
+		if('\'' == c)
+			return 0;
+		if('\\' != c) {
+			if(EOF == c || (c = decodeCopyChar(multibyte, c, in, out)))
+				return EOF == c ? EILSEQ : c;
+			continue;
+		}
+		switch(c = inGetc(in)) {
+		case '\\':
+		case '\'':
+			outPutc(c, out);
+			break;
+		case '0' ... '7':
+			in->pos--;
+			decodeDigits(in, 8, 3, &value);
+			if(0377 < value)
+				return EILSEQ;
+			outPutc(value, out);
+			break;
+		case 'u':
+		case 'U':
+			if(! decodeDigits(in, 16, 'u' == c ? 4 : 8, &value))
+				return EILSEQ;
+			if((c = decodeCodePoint(opts, value, out)))
+				return c;
+			break;
+		//  ansiEscapes is mostly zeros, so only its letters may be looked up in it
+		case 'a':
+		case 'b':
+		case 't':
+		case 'n':
+		case 'v':
+		case 'f':
+		case 'r':
+		case 'E':
+			outPutc((const char *)memchr(ansiEscapes, c, sizeof(ansiEscapes)) - ansiEscapes, out);
+			break;
+		default:
+			return EILSEQ;
+		}
+	}
+}
+
+int printfq_decode_stream(const printfq_opts * opts, printfq_input * in, printfq_output * out)
+{
+	const unsigned flushArguments = opts->flags & PRINTFQ_FLUSH_ARGUMENTS;
+	const unsigned multibyte = PRINTFQ_CHARSET_LOCALE == opts->charset;
+	TRACE_BEGIN(out);
+	int c = inGetc(in);
+	int rc = 0;
+	while(! rc) {
+		while(isDecodeDelimiter(c))
+			c = inGetc(in);
+		if(EOF == c)
+			break;
+		if('~' == c)
+			rc = EILSEQ;
+		while(! rc && EOF != c && ! isDecodeDelimiter(c)) {
+			if('\'' == c)
+				rc = decodeQuoted(in, out);
+			else if('$' == c)
+				rc = '\'' == inGetc(in) ? decodeAnsiQuoted(opts, in, out) : EILSEQ;
+			else if('\\' == c)
+				rc = EOF == (c = inGetc(in)) || '\n' == c ? EILSEQ :
+					decodeCopyChar(multibyte, c, in, out);
+			else if(0x80 > c && shControlChars[c])
+				rc = EILSEQ;
+			else {
+				rc = decodeCopyChar(multibyte, c, in, out);
+				copySafeAscii(in, out);
+			}
+			c = inGetc(in);
+		}
+		if(! rc) {
+			outEndString(1, in, out);
+			outPutc(0, out);
+			if(flushArguments)
+				outFlush(out);
+		}
+	}
+	if(out->pos != out->buf)
+		outFlush(out);
+	TRACE_END();
+	if(in->error || (! rc && out->error))
+		rc = in->error ? in->error : out->error;
+	if(rc) {
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+size_t printfq_decode(const char * in, size_t len, char * out, size_t cap, const printfq_opts * opts)
+{
+	return fixedStream(printfq_decode_stream, in, len, out, cap, opts);
+}
+
+//  Output to an arena that is grown as needed
+struct arenaOutput {
+	printfq_output out;
+	char ** arena;
+	size_t * cap;
+};
+
+static int arenaOutputFlush(printfq_output * out)
+{
+	struct arenaOutput * arena = (struct arenaOutput *)out;
+	//  Keep the output in the arena until it is full
+	if(out->pos != out->end)
+		return 0;
+	size_t used = out->pos - out->buf;
+	size_t cap = *arena->cap > 2048 ? *arena->cap : 2048;
+	char * grown;
+	if(cap > SIZE_MAX >> 1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if(! (grown = realloc(*arena->arena, cap <<= 1)))
+		return -1;
+	*arena->arena = out->buf = grown;
+	*arena->cap = cap;
+	out->pos = grown + used;
+	out->end = grown + cap;
+	return 0;
+}
+
+//  The cache.  Entries are found through a table of chains, by a hash of the input and the
+// options, and evicted in CLOCK order:  the hand sweeps over the entries, clearing the referenced
+// flag of each one that has been hit since the hand last passed it, and evicts the first one that
+// has not been.  The data of each entry is a copy of its input followed by its output.
+#define CACHE_NONE UINT32_MAX
+#define CACHE_MINIMUM_ENTRIES 16
+#define CACHE_MAXIMUM_ENTRIES (1 << 24)
+//  The number of entries is the size divided by this
+#define CACHE_BYTES_PER_ENTRY 64
+
+struct cacheEntry {
+	//  NULL for an unused entry
+	char * data;
+	size_t inLen;
+	size_t outLen;
+	uint64_t hash;
+	unsigned flags;
+	unsigned charset;
+	uint32_t next;
+	unsigned referenced;
+};
+
+struct printfq_cache {
+	printfq_cache_stats stats;
+	size_t size;
+	size_t used;
+	uint32_t mask;
+	uint32_t count;
+	uint32_t hand;
+	uint32_t * heads;
+	struct cacheEntry entries[];
+};
+
+static uint64_t cacheHash(const char * in, size_t len, const printfq_opts * opts)
+{
+	uint64_t h = ((uint64_t)opts->flags << 32 | opts->charset) ^ len * 0x9E3779B97F4A7C15ULL;
+	uint64_t w;
+	for(; 8 <= len; in += 8, len -= 8) {
+		memcpy(&w, in, 8);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	w = 0;
+	//  in may be NULL when len is 0, as for an empty printfq_string
+	if(len)
+		memcpy(&w, in, len);
+	h = (h ^ w) * 0xC4CEB9FE1A85EC53ULL;
+	return h ^ h >> 29;
+}
+
+printfq_cache * printfq_cache_new(size_t size)
+{
+	size_t count = size / CACHE_BYTES_PER_ENTRY;
+	count = CACHE_MINIMUM_ENTRIES > count ? CACHE_MINIMUM_ENTRIES :
+		CACHE_MAXIMUM_ENTRIES < count ? CACHE_MAXIMUM_ENTRIES : count;
+	uint32_t buckets = CACHE_MINIMUM_ENTRIES;
+	while(buckets < count)
+		buckets <<= 1;
+	printfq_cache * cache = calloc(1, sizeof(*cache) + count * sizeof(struct cacheEntry));
+	if(! cache)
+		return NULL;
+	if(! (cache->heads = malloc(buckets * sizeof(*cache->heads)))) {
+		free(cache);
+		return NULL;
+	}
+	//  Every byte of CACHE_NONE is 0xFF
+	memset(cache->heads, 0xFF, buckets * sizeof(*cache->heads));
+	cache->size = size;
+	cache->mask = buckets - 1;
+	cache->count = count;
+	return cache;
+}
+
+void printfq_cache_free(printfq_cache * cache)
+{
+	if(! cache)
+		return;
+	for(uint32_t idx = 0; idx < cache->count; idx++)
+		free(cache->entries[idx].data);
+	free(cache->heads);
+	free(cache);
+}
+
+const printfq_cache_stats * printfq_cache_get_stats(const printfq_cache * cache)
+{
+	return &cache->stats;
+}
+
+const char * printfq_cache_lookup(printfq_cache * cache, const char * in, size_t len,
+	const printfq_opts * opts, size_t * outLen)
+{
+	uint64_t hash = cacheHash(in, len, opts);
+	struct cacheEntry * e;
+	for(uint32_t idx = cache->heads[hash & cache->mask]; CACHE_NONE != idx; idx = e->next) {
+		e = cache->entries + idx;
+		if(hash == e->hash && len == e->inLen && opts->flags == e->flags &&
+			opts->charset == e->charset && (! len || ! memcmp(in, e->data, len)))
+		{
+			e->referenced = 1;
+			cache->stats.hits++;
+			*outLen = e->outLen;
+			return e->data + len;
+		}
+	}
+	cache->stats.misses++;
+	return NULL;
+}
+
+static void cacheEvict(printfq_cache * cache, struct cacheEntry * e)
+{
+	uint32_t * link = cache->heads + (e->hash & cache->mask);
+	while(cache->entries + *link != e)
+		link = &cache->entries[*link].next;
+	*link = e->next;
+	cache->used -= e->inLen + e->outLen;
+	free(e->data);
+	e->data = NULL;
+	cache->stats.evictions++;
+}
+
+int printfq_cache_insert(printfq_cache * cache, const char * in, size_t len,
+	const printfq_opts * opts, const char * out, size_t outLen)
+{
+	size_t size = len + outLen;
+	if(size < len || size > cache->size >> 2)
+		return 0;
+	char * data = malloc(size ? size : 1);
+	if(! data)
+		return -1;
+	if(len)
+		memcpy(data, in, len);
+	if(outLen)
+		memcpy(data + len, out, outLen);
+	//  Sweep until the hand is on an unused entry and there is room
+	struct cacheEntry * e;
+	for(;; cache->hand = (cache->hand + 1) % cache->count) {
+		e = cache->entries + cache->hand;
+		if(e->data) {
+			if(e->referenced) {
+				e->referenced = 0;
+				continue;
+			}
+			cacheEvict(cache, e);
+		}
+		if(cache->used + size <= cache->size)
+			break;
+	}
+	cache->hand = (cache->hand + 1) % cache->count;
+	uint32_t * head = cache->heads + ((e->hash = cacheHash(in, len, opts)) & cache->mask);
+	e->data = data;
+	e->inLen = len;
+	e->outLen = outLen;
+	e->flags = opts->flags;
+	e->charset = opts->charset;
+	e->referenced = 0;
+	e->next = *head;
+	*head = e - cache->entries;
+	cache->used += size;
+	return 0;
+}
+
+size_t printfq_escape_batch_cached(const printfq_string * strings, size_t count,
+	printfq_span * spans, char ** arena, size_t * cap, const printfq_opts * opts,
+	printfq_cache * cache)
+{
+	struct arenaOutput output = {.out = {
+		.buf = *arena,
+		.pos = *arena,
+		.end = *arena + *cap,
+		.flush = arenaOutputFlush
+	}, .arena = arena, .cap = cap};
+	for(size_t idx = 0; idx < count; idx++) {
+		printfq_input input = {
+			.pos = (const unsigned char *)strings[idx].ptr,
+			.end = (const unsigned char *)strings[idx].ptr + strings[idx].len
+		};
+		const char * cached = NULL;
+		size_t length;
+		spans[idx].offset = output.out.pos - output.out.buf;
+		if(cache && (cached = printfq_cache_lookup(cache, strings[idx].ptr, strings[idx].len,
+			opts, &length)))
+		{
+			if(outWrite(cached, length, &output.out)) {
+				errno = output.out.error;
+				return (size_t)-1;
+			}
+		}
+		else if(printfq_escape_stream(opts, &input, &output.out))
+			return (size_t)-1;
+		spans[idx].length = output.out.pos - output.out.buf - spans[idx].offset;
+		//  An entry that cannot be added is only a miss the next time
+		if(cache && ! cached)
+			printfq_cache_insert(cache, strings[idx].ptr, strings[idx].len, opts,
+				output.out.buf + spans[idx].offset, spans[idx].length);
+	}
+	return output.out.pos - output.out.buf;
+}
+
+size_t printfq_escape_batch(const printfq_string * strings, size_t count, printfq_span * spans,
+	char ** arena, size_t * cap, const printfq_opts * opts)
+{
+	return printfq_escape_batch_cached(strings, count, spans, arena, cap, opts, NULL);
+}
+
+#ifdef PRINTFQ_GENERATE_CLASSES
+//  Write the tables for PRINTFQ_STATIC_CLASSES builds to stdout, classified from the UTF-8
+// locale named by the first argument, or C.UTF-8.  Blocks with the same classes are written once.
+#include <locale.h>
+
+int main(int argc, char ** argv)
+{
+	static unsigned char blocks[CLASS_BLOCK_COUNT + 4][CLASS_BLOCK_SIZE];
+	static uint16_t index[CLASS_BLOCK_COUNT];
+	const char * locale = 1 < argc ? argv[1] : "C.UTF-8";
+	if(! setlocale(LC_CTYPE, locale) || strcmp("UTF-8", nl_langinfo(CODESET))) {
+		fprintf(stderr, "printfq-classes: %s is not an available UTF-8 locale\n", locale);
+		return 1;
+	}
+	unsigned count = 4;
+	memcpy(blocks, uniformClassBlocks, sizeof(uniformClassBlocks));
+	for(unsigned i = 0; i < CLASS_BLOCK_COUNT; i++) {
+		unsigned j = 0;
+		classifyBlock(blocks[count], i);
+		while(memcmp(blocks[j], blocks[count], CLASS_BLOCK_SIZE))
+			j++;
+		count += j == count;
+		index[i] = j;
+	}
+	printf("//  Generated by printfq-classes from the %s locale.  Do not edit.\n"
+		"static const unsigned char staticClassBlocks[%u][CLASS_BLOCK_SIZE] = {\n", locale, count);
+	for(unsigned i = 0; i < count; i++)
+		for(unsigned j = 0; j < CLASS_BLOCK_SIZE; j++)
+			printf("%s0x%02X%s", j % 16 ? " " : j ? "\n\t\t" : "\t{", blocks[i][j],
+				CLASS_BLOCK_SIZE - 1 > j ? "," : i + 1 < count ? "},\n" : "}\n");
+	printf("};\nstatic const uint16_t staticClassIndex[CLASS_BLOCK_COUNT] = {");
+	for(unsigned i = 0; i < CLASS_BLOCK_COUNT; i++)
+		printf("%s%u%s", i % 16 ? " " : "\n\t", index[i], CLASS_BLOCK_COUNT - 1 > i ? "," : "\n");
+	printf("};\n");
+	return ferror(stdout) || fflush(stdout) ? 1 : 0;
+}
+#endif
@@ -11,162 +11,1429 @@
 "License: GPLv2 <https://www.gnu.org/licenses/old-licenses/gpl-2.0.html>\n" \
 "See https://github.com/jacre8/printfq for the latest version and documentation"
 
-//  As written, it is assumed that wchar_t stores a Unicode code point for \u and \U output
-// with wide characters, and inside iswprintExt() and iswNotBlank().
-#ifndef __STDC_ISO_10646__
-#warning The Unicode code point mapping has not been tested in this configuration!
-#endif
-
 const char versionString[] = "printfq version 3";
 
 #define _GNU_SOURCE
-#include <ctype.h>  // isprint()
+#include "printfq.h"
+#include <ctype.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <errno.h>
-#include <langinfo.h> //nl_langinfo
+#include <limits.h>
 #include <locale.h>
-#include <stdio.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sysexits.h>
-#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
-#include <wchar.h>
-#include <wctype.h> // iswprint()
-
-//  In addition to those characters identified by iswprint() as non-printable, this function
-// identifies unicode characters that are invisible by themselves, including 0-space characters.
-// This is a subset of the list at https://invisible-characters.com/.  Space characters from that
-// list with a non-zero width have been omitted here, but appear in iswNotBlank().
-static int iswprintExt(wint_t c)
-{
-	return iswprint(c) &&
-	//  None of the uncommented are excluded by iswprint() in glibc v2.28
-	//  0x9, 0x20 and 0xA0 are non-zero spaces
-	// 0xAD renders in my terminal as a non-zero space, although it shouldn't
-	0xAD != c &&
-	0x034F != c &&
-	0x061C != c &&
-	0x115F != c &&
-	0x1160 != c &&
-	0x17B4 != c &&
-	0x17B5 != c &&
-	(0x180B > c || 0x180E < c) &&
-	//  0x2000 - 0x200A are non-zero spaces
-	(0x200B > c || 0x200F < c) &&
-	(0x202A > c || 0x202E < c) &&
-	//  0x202F and 0x205F are non-zero spaces
-	(0x2060 > c || 0x206F < c) &&
-	//  0x2800, 0x3000, and 0x3164 are non-zero spaces
-	(0xFE00 > c || 0xFE0F < c) &&
-	0xFEFF != c &&
-	0xFFA0 != c &&
-	//  0xFFFC renders as a non-zero space for me, but it shouldn't
-	0xFFFC != c &&
-	// 0x133FC renders as a non-zero space but is, by definition, printable
-	// 0x1D159 renders as a non-zero space for me, but it shouldn't
-	0x1D159 != c &&
-	(0x1D173 > c || 0x1D17A < c) &&
-	0xE0001 != c &&
-	(0xE0020 > c || 0xE007F < c) &&
-	(0xE0100 > c || 0xE01EF < c);
-}
-
-//  This will return true if the character is graphic or is a regular space.
-static int iswNotBlank(wint_t c)
-{
-	//  0x9 and 0x20 are recognized by iswspace().  That aside, 0x20 will not be escaped
-	// (iswprintExt() returns true for it) and iswprintExt() returns false for all other whitespace
-	// characters below 128.  Futhermore, the control characters in the 0x80-0x9F block are
-	// caught by iswprint(), and the only other non-graphic characters below 256 are 0xAD and
-	// 0xA0 which are both explicitly checked for.
-	return iswprintExt(c) && (0x100 > c ? 0xA0 != c : ! (
-		iswspace(c) ||
-		//  None of the uncommented are caught by iswspace() in glibc v2.28
-		//0xA0 == c ||
-		// 0x2000 - 0x2006 are caught by iswspace(), as are 0x2008-0x200A, but not 0x2007
-		//(0x2000 <= c && 0x200A >= c) ||
-		0x2007 == c ||
-		0x202F == c ||
-		//0x205F == c || // caught by iswspace()
-		0x2800 == c ||
-		//0x3000 == c || // caught by iswspace()
-		0x3164 == c
-	));
-}
-
-static char stdoutBuffer[BUFSIZ];
-static char stdinBuffer[BUFSIZ];
+#ifdef PRINTFQ_URING
+	#include <liburing.h>
+#endif
 
-int main(int argc, char **argv)
+#define DEFAULT_BUFFER_SIZE (128 * 1024)
+#define MINIMUM_BUFFER_SIZE 64
+
+static char * inputBuffer;
+static int inputFd = STDIN_FILENO;
+static size_t bufferSize = DEFAULT_BUFFER_SIZE;
+//  For --stats
+static size_t inputBytes;
+static size_t outputBytes;
+//  What is done to the input, which is decoding with --decode
+static int (* transform)(const printfq_opts * opts, printfq_input * in, printfq_output * out) =
+	printfq_escape_stream;
+#ifdef __linux__
+	//  The mapped input, and whether spans of it may be spliced into a stdout pipe
+	static const unsigned char * mapStart;
+	static const unsigned char * mapEnd;
+	static int spliceOutput;
+#endif
+
+//  --flush-idle and --flush-delay.  Streamed output otherwise waits in the buffer until it fills,
+// which can be a long time when the input trickles in, so the policy is applied before each
+// read.  Pending output is written if the read would block, or once it has waited flushDelay
+// microseconds, in which case the wait for input is bounded by what remains of the delay.
+// Output is counted as pending from the first read after the library last flushed.
+static printfq_output * policyOutput;
+static unsigned flushIdle;
+static unsigned long flushDelay;
+static size_t pendingFlushes = SIZE_MAX;
+static struct timespec pendingSince;
+
+static int policyFlush(printfq_output * out)
+{
+	//  Counted as though the library had flushed
+	out->stats.flushes++;
+	out->stats.writtenBytes += out->pos - out->buf;
+	return out->flush(out);
+}
+
+static int flushBeforeRead(void)
+{
+	printfq_output * out = policyOutput;
+	struct timespec timeout = {0, 0};
+	if(! out || out->pos == out->buf)
+		return 0;
+	if(flushDelay) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(pendingFlushes != out->stats.flushes) {
+			pendingFlushes = out->stats.flushes;
+			pendingSince = now;
+		}
+		unsigned long long waited = (now.tv_sec - pendingSince.tv_sec) * 1000000ULL +
+			now.tv_nsec / 1000 - pendingSince.tv_nsec / 1000;
+		if(waited >= flushDelay)
+			return policyFlush(out);
+		if(! flushIdle) {
+			timeout.tv_sec = (flushDelay - waited) / 1000000;
+			timeout.tv_nsec = (flushDelay - waited) % 1000000 * 1000;
+		}
+	}
+	struct pollfd pfd = {inputFd, POLLIN, 0};
+	int rc;
+	while(0 > (rc = ppoll(&pfd, 1, &timeout, NULL)) && EINTR == errno);
+	return rc ? 0 : policyFlush(out);
+}
+
+static ssize_t inputRefill(printfq_input * in)
+{
+	if(flushBeforeRead())
+		return -1;
+	//  Keep any partial character that the library has not consumed yet
+	size_t pending = in->end - in->pos;
+	if(pending)
+		memmove(inputBuffer, in->pos, pending);
+	in->pos = (const unsigned char *)inputBuffer;
+	in->end = in->pos + pending;
+	ssize_t rc;
+	while(0 > (rc = read(inputFd, inputBuffer + pending, bufferSize - pending)) &&
+		EINTR == errno);
+	if(0 < rc) {
+		in->end += rc;
+		inputBytes += rc;
+	}
+	return rc;
+}
+
+//  Map the rest of a regular file so that it can be escaped without being read into a buffer.
+// Returns 0 on success, or -1 if the input must be streamed instead.
+static int mapInput(printfq_input * in)
+{
+	struct stat st;
+	if(fstat(inputFd, &st) || ! S_ISREG(st.st_mode))
+		return -1;
+	//  Start from the current offset, in case part of stdin has already been consumed
+	off_t offset = lseek(inputFd, 0, SEEK_CUR);
+	if(0 > offset || offset >= st.st_size || (uintmax_t)(st.st_size - offset) > SIZE_MAX >> 1)
+		return -1;
+	off_t start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	size_t size = st.st_size - start;
+	const unsigned char * map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, inputFd, start);
+	if(MAP_FAILED == map)
+		return -1;
+	madvise((void *)map, size, MADV_SEQUENTIAL);
+	in->pos = map + (offset - start);
+	in->end = map + size;
+	inputBytes += in->end - in->pos;
+	#ifdef __linux__
+		struct stat outSt;
+		mapStart = in->pos;
+		mapEnd = in->end;
+		spliceOutput = ! fstat(STDOUT_FILENO, &outSt) && S_ISFIFO(outSt.st_mode);
+	#endif
+	in->refill = NULL;
+	return 0;
+}
+
+//  --shard.  The mapped input is divided into byte ranges of the same size, one per shard, and
+// only the strings that start in the range of shard, counting from 1, are escaped.  A string
+// starts at the beginning of the input or after a null character, so each end of the range is
+// moved forward to the next start.  The output of the shards then concatenates to the output for
+// the whole input, except that with space delimiters, the delimiter between the last string of a
+// shard and the first of the next must be added.  Returns 1 if it must be added after this shard,
+// 0 if not, or -1 if the shard is empty.
+#define MAXIMUM_SHARDS 65536
+
+static int shardInput(printfq_input * in, unsigned long shard, unsigned long shards,
+	unsigned delimit)
+{
+	const unsigned char * base = in->pos;
+	size_t size = in->end - in->pos;
+	const unsigned char * bounds[2];
+	for(unsigned idx = 0; idx < 2; idx++) {
+		//  size * part / shards, without overflowing
+		unsigned long part = shard - 1 + idx;
+		size_t offset = size / shards * part + size % shards * part / shards;
+		const unsigned char * nul = offset ? memchr(base + offset - 1, 0, size - offset + 1) : NULL;
+		bounds[idx] = ! offset ? base : nul ? nul + 1 : in->end;
+	}
+	in->pos = bounds[0];
+	in->end = bounds[1];
+	inputBytes -= size - (bounds[1] - bounds[0]);
+	if(bounds[0] == bounds[1])
+		return -1;
+	return delimit && bounds[1] != base + size;
+}
+
+//  Provide each argument, including its null terminator, as the next block of input.  No
+// character can be split across arguments since each ends with a null, so nothing in front of
+// pos needs to be kept.
+static ssize_t argvRefill(printfq_input * in)
+{
+	char ** argv = in->handle;
+	if(! *argv)
+		return 0;
+	size_t size = strlen(*argv) + 1;
+	in->pos = (const unsigned char *)*argv;
+	in->end = in->pos + size;
+	in->handle = argv + 1;
+	//  Arguments may be escaped by several threads
+	__atomic_add_fetch(&inputBytes, size, __ATOMIC_RELAXED);
+	return size;
+}
+
+//  --checkpoint and --resume.  The end of each string is a point that escaping can resume from,
+// since each string is escaped on its own and no decoder reads past a null terminator.  Once the
+// output up to one of those points has been written, the point may be saved to the checkpoint file
+// as the input and output file offsets, after at least bufferSize more output than the last one.
+// A resumed run seeks both files to those offsets and truncates the output there.
+#define CHECKPOINT_FORMAT "printfq checkpoint %20jd %20jd\n"
+
+static int checkpointFd = -1;
+//  The file offsets that inputBytes and outputBytes count from
+static off_t inputStart;
+static off_t outputStart;
+//  Where the string after the last one to end starts, and what was last saved
+static size_t checkpointInput;
+static size_t checkpointOutput = SIZE_MAX;
+static size_t checkpointedOutput;
+static unsigned resumed;
+
+static int writeCheckpoint(size_t input, size_t output)
+{
+	char text[64];
+	//  Always the same length, so each checkpoint overwrites the last one in place
+	int len = snprintf(text, sizeof(text), CHECKPOINT_FORMAT, (intmax_t)(inputStart + input),
+		(intmax_t)(outputStart + output));
+	if(len != pwrite(checkpointFd, text, len, 0))
+		return -1;
+	checkpointedOutput = output;
+	return 0;
+}
+
+//  Called after output is written
+static int checkpointWritten(void)
+{
+	return 0 <= checkpointFd && checkpointOutput <= outputBytes &&
+		checkpointOutput - checkpointedOutput >= bufferSize ?
+		writeCheckpoint(checkpointInput, checkpointOutput) : 0;
+}
+
+//  Find the offsets to start from, continuing from the checkpoint when resume is set and there is
+// one.  Non-seekable input is read up to the checkpoint and discarded.  Output that is not a regular
+// file is not truncated, so the output of the resumed run follows what has already been written.
+// Returns 0, or an exit status.
+static int startCheckpoint(unsigned resume)
+{
+	char text[64];
+	intmax_t input, output;
+	struct stat st;
+	ssize_t len = resume ? pread(checkpointFd, text, sizeof(text) - 1, 0) : 0;
+	if(0 > len) {
+		perror("printfq: checkpoint");
+		return EX_IOERR;
+	}
+	if(! len) {
+		int fl = fcntl(STDOUT_FILENO, F_GETFL);
+		if(0 > (inputStart = lseek(inputFd, 0, SEEK_CUR)))
+			inputStart = 0;
+		if(0 > fl || ! (fl & O_APPEND) || fstat(STDOUT_FILENO, &st) || ! S_ISREG(st.st_mode))
+			outputStart = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		else
+			outputStart = st.st_size;
+		if(0 > outputStart)
+			outputStart = 0;
+		return 0;
+	}
+	text[len] = 0;
+	if(2 != sscanf(text, "printfq checkpoint %jd %jd", &input, &output) || 0 > input || 0 > output) {
+		fputs("printfq: Invalid checkpoint\n", stderr);
+		return EX_DATAERR;
+	}
+	if(0 > lseek(inputFd, input, SEEK_SET)) {
+		char * buf;
+		ssize_t rc = 1;
+		if(ESPIPE != errno || ! (buf = malloc(bufferSize))) {
+			perror("printfq: resume");
+			return EX_IOERR;
+		}
+		for(intmax_t left = input; left && (0 < rc || (0 > rc && EINTR == errno)); left -= 0 < rc ? rc : 0)
+			rc = read(inputFd, buf, (uintmax_t)left < bufferSize ? (size_t)left : bufferSize);
+		free(buf);
+		if(0 > rc) {
+			perror("printfq: resume");
+			return EX_IOERR;
+		}
+		if(! rc) {
+			fputs("printfq: The input ends before the checkpoint\n", stderr);
+			return EX_DATAERR;
+		}
+	}
+	if(! fstat(STDOUT_FILENO, &st) && S_ISREG(st.st_mode)) {
+		if(st.st_size < output) {
+			fputs("printfq: The output ends before the checkpoint\n", stderr);
+			return EX_DATAERR;
+		}
+		if(ftruncate(STDOUT_FILENO, output) || 0 > lseek(STDOUT_FILENO, output, SEEK_SET)) {
+			perror("printfq: resume");
+			return EX_IOERR;
+		}
+	}
+	inputStart = input;
+	outputStart = output;
+	resumed = 1;
+	return 0;
+}
+
+//  Write all of iov to stdout, resuming after partial writes
+static int writeAll(struct iovec * iov, int iovcnt)
+{
+	while(iovcnt) {
+		ssize_t rc = writev(STDOUT_FILENO, iov, iovcnt);
+		if(0 > rc) {
+			if(EINTR == errno)
+				continue;
+			return -1;
+		}
+		outputBytes += rc;
+		for(; iovcnt && (size_t)rc >= iov->iov_len; iov++, iovcnt--)
+			rc -= iov->iov_len;
+		if(iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return checkpointWritten();
+}
+
+static int stdoutFlush(printfq_output * out)
+{
+	struct iovec iov = {out->buf, out->pos - out->buf};
+	out->pos = out->buf;
+	return writeAll(&iov, 1);
+}
+
+//  The delimiter between the last string of a --shard and the first of the next
+static int writeShardDelimiter(void)
+{
+	struct iovec iov = {" ", 1};
+	return writeAll(&iov, 1);
+}
+
+#ifdef __linux__
+//  Move the pages of iov into the stdout pipe instead of copying them.  The pipe then references
+// the page cache of the input file, so this is only done for unescaped spans of mapped input,
+// which is never modified.  iov is updated to what remains on error.
+static int spliceAll(struct iovec * iov)
+{
+	while(iov->iov_len) {
+		ssize_t rc = vmsplice(STDOUT_FILENO, iov, 1, 0);
+		if(0 > rc) {
+			if(EINTR == errno)
+				continue;
+			return -1;
+		}
+		iov->iov_base = (char *)iov->iov_base + rc;
+		iov->iov_len -= rc;
+		outputBytes += rc;
+	}
+	return checkpointWritten();
+}
+#endif
+
+//  Write the buffer and a large block together, without copying the block into the buffer
+static int stdoutWrite(printfq_output * out, const void * ptr, size_t size)
+{
+	struct iovec iov[2] = {{out->buf, out->pos - out->buf}, {(void *)ptr, size}};
+	out->pos = out->buf;
+	#ifdef __linux__
+		if(spliceOutput && mapStart <= (const unsigned char *)ptr &&
+			mapEnd >= (const unsigned char *)ptr + size)
+		{
+			if(writeAll(iov, 1))
+				return -1;
+			if(! spliceAll(iov + 1))
+				return 0;
+			if(EINVAL != errno && ENOSYS != errno)
+				return -1;
+			//  Splicing is not supported here, so write this and everything else normally
+			spliceOutput = 0;
+			return writeAll(iov + 1, 1);
+		}
+	#endif
+	return writeAll(iov, 2);
+}
+
+#ifdef PRINTFQ_URING
+//  --io=uring.  Input is read into one ring of buffers and output is written from another, with
+// all of them registered with the kernel, so that the reads and writes overlap with escaping.
+// Regular files are read and written at explicit offsets, so several buffers can be in flight at
+// once.  Anything else, such as a pipe, has no offsets, so to keep its order, there is only one
+// read and one write in flight at a time:  the next buffer of input is read while one is escaped,
+// and one buffer of output is written while the next is filled.  Each input buffer has room in
+// front of it for the partial character that the library may leave at the end of the last one.
+#define URING_BUFFERS 4
+#define URING_MARGIN 16
+#define URING_MAXIMUM_IO (1 << 30)
+
+struct uringSlot {
+	char * buf;
+	//  Bytes read, or bytes to write and bytes written so far
+	size_t len;
+	size_t done;
+	//  The file offset of the buffer, or -1 without offsets
+	off_t offset;
+	unsigned index;
+	int busy;
+	//  Input that has been read, which may be empty at the end of the input, or a read error
+	int ready;
+	int error;
+};
+
+static struct {
+	struct io_uring ring;
+	int fixed;
+	struct uringSlot in[URING_BUFFERS];
+	struct uringSlot out[URING_BUFFERS];
+	//  The most reads or writes in flight at once
+	unsigned inDepth;
+	unsigned outDepth;
+	//  The next input slot to escape, the one being escaped, and the next one to read into
+	unsigned inHead;
+	struct uringSlot * inCurrent;
+	unsigned inNext;
+	int inEof;
+	off_t inOffset;
+	//  The output slot being filled
+	unsigned outFill;
+	off_t outOffset;
+	int writeError;
+} uring;
+
+static int uringSubmit(struct uringSlot * s, int write)
+{
+	struct io_uring_sqe * sqe = io_uring_get_sqe(&uring.ring);
+	//  Only the remainder of a short read or write is submitted again
+	char * buf = write ? s->buf + s->done : s->buf + URING_MARGIN + s->len;
+	size_t size = write ? s->len - s->done : bufferSize - s->len;
+	__u64 offset = 0 > s->offset ? (__u64)-1 : (__u64)s->offset + (write ? s->done : s->len);
+	if(URING_MAXIMUM_IO < size)
+		size = URING_MAXIMUM_IO;
+	if(write && uring.fixed)
+		io_uring_prep_write_fixed(sqe, STDOUT_FILENO, buf, size, offset, s->index);
+	else if(write)
+		io_uring_prep_write(sqe, STDOUT_FILENO, buf, size, offset);
+	else if(uring.fixed)
+		io_uring_prep_read_fixed(sqe, inputFd, buf, size, offset, s->index);
+	else
+		io_uring_prep_read(sqe, inputFd, buf, size, offset);
+	io_uring_sqe_set_data(sqe, s);
+	s->busy = 1;
+	int rc = io_uring_submit(&uring.ring);
+	if(0 > rc) {
+		errno = -rc;
+		return -1;
+	}
+	return 0;
+}
+
+//  Wait for a read or write to complete, and handle it
+static int uringComplete(void)
+{
+	struct io_uring_cqe * cqe;
+	int rc = io_uring_wait_cqe(&uring.ring, &cqe);
+	if(0 > rc) {
+		errno = -rc;
+		return -1;
+	}
+	struct uringSlot * s = io_uring_cqe_get_data(cqe);
+	int res = cqe->res;
+	io_uring_cqe_seen(&uring.ring, cqe);
+	int write = s >= uring.out && s < uring.out + URING_BUFFERS;
+	s->busy = 0;
+	if(-EINTR == res || -EAGAIN == res)
+		return uringSubmit(s, write);
+	if(write) {
+		if(0 >= res) {
+			uring.writeError = res ? -res : EIO;
+			return 0;
+		}
+		s->done += res;
+		outputBytes += res;
+		return s->done < s->len ? uringSubmit(s, 1) : 0;
+	}
+	if(0 > res)
+		s->error = -res;
+	else {
+		s->len += res;
+		inputBytes += res;
+		if(! res)
+			uring.inEof = 1;
+		//  A buffer of a regular file is filled before it is escaped, so that the reads ahead of it
+		// remain contiguous with it
+		else if(0 <= s->offset && s->len < bufferSize)
+			return uringSubmit(s, 0);
+	}
+	s->ready = 1;
+	return 0;
+}
+
+static unsigned uringBusy(const struct uringSlot * slots)
+{
+	unsigned n = 0;
+	for(unsigned i = 0; i < URING_BUFFERS; i++)
+		n += slots[i].busy;
+	return n;
+}
+
+//  Start reads into free input slots, in order
+static int uringStartReads(void)
+{
+	while(! uring.inEof && uringBusy(uring.in) < uring.inDepth) {
+		struct uringSlot * s = uring.in + uring.inNext;
+		if(s->busy || s->ready || s == uring.inCurrent)
+			break;
+		s->len = 0;
+		s->offset = uring.inOffset;
+		if(0 <= uring.inOffset)
+			uring.inOffset += bufferSize;
+		if(uringSubmit(s, 0))
+			return -1;
+		uring.inNext = (uring.inNext + 1) % URING_BUFFERS;
+	}
+	return 0;
+}
+
+static ssize_t uringRefill(printfq_input * in)
+{
+	struct uringSlot * s = uring.in + uring.inHead;
+	size_t pending = in->end - in->pos;
+	if(URING_MARGIN < pending) {
+		errno = EINVAL;
+		return -1;
+	}
+	//  The margin is never read into, so this is safe even while the read is in flight
+	memmove(s->buf + URING_MARGIN - pending, in->pos, pending);
+	if(uring.inCurrent) {
+		uring.inCurrent->ready = 0;
+		uring.inCurrent = NULL;
+	}
+	if(uringStartReads())
+		return -1;
+	while(! s->ready)
+		if(! s->busy && uring.inEof) {
+			//  No read was started for this slot since an earlier one reached the end
+			s->len = 0;
+			s->ready = 1;
+		}
+		else if(uringComplete())
+			return -1;
+	in->pos = (const unsigned char *)s->buf + URING_MARGIN - pending;
+	in->end = (const unsigned char *)s->buf + URING_MARGIN + s->len;
+	if(s->error) {
+		errno = s->error;
+		return -1;
+	}
+	//  The slot at the end of the input is left for any further calls
+	if(s->len) {
+		uring.inCurrent = s;
+		uring.inHead = (uring.inHead + 1) % URING_BUFFERS;
+		//  Read ahead while this is escaped
+		if(uringStartReads())
+			return -1;
+	}
+	return s->len;
+}
+
+//  Wait until no more than limit writes are in flight
+static int uringWaitWrites(unsigned limit)
+{
+	while(uringBusy(uring.out) > limit)
+		if(uringComplete())
+			return -1;
+	if(uring.writeError) {
+		errno = uring.writeError;
+		return -1;
+	}
+	return 0;
+}
+
+static int uringFlush(printfq_output * out)
+{
+	struct uringSlot * s = uring.out + uring.outFill;
+	size_t size = out->end - out->buf;
+	if(! (s->len = out->pos - out->buf))
+		return 0;
+	if(uringWaitWrites(uring.outDepth - 1))
+		return -1;
+	s->done = 0;
+	s->offset = uring.outOffset;
+	if(0 <= uring.outOffset)
+		uring.outOffset += s->len;
+	if(uringSubmit(s, 1))
+		return -1;
+	uring.outFill = (uring.outFill + 1) % URING_BUFFERS;
+	s = uring.out + uring.outFill;
+	while(s->busy)
+		if(uringComplete())
+			return -1;
+	out->buf = out->pos = s->buf;
+	out->end = s->buf + size;
+	return 0;
+}
+
+//  Returns the file offset to use, or -1 for a file that must be accessed in order
+static off_t uringOffset(int fd)
+{
+	struct stat st;
+	int fl = fcntl(fd, F_GETFL);
+	return fstat(fd, &st) || ! S_ISREG(st.st_mode) || 0 > fl || fl & O_APPEND ? -1 :
+		lseek(fd, 0, SEEK_CUR);
+}
+
+//  Set up the rings and switch in and out over to them.  Returns -1 if io_uring cannot be used.
+static int uringInit(printfq_input * in, printfq_output * out)
+{
+	struct iovec iov[URING_BUFFERS << 1];
+	if(io_uring_queue_init(URING_BUFFERS << 1, &uring.ring, 0))
+		return -1;
+	for(unsigned i = 0; i < URING_BUFFERS << 1; i++) {
+		struct uringSlot * s = i < URING_BUFFERS ? uring.in + i : uring.out + i - URING_BUFFERS;
+		iov[i].iov_len = i < URING_BUFFERS ? URING_MARGIN + bufferSize : bufferSize;
+		if(! (iov[i].iov_base = s->buf = malloc(iov[i].iov_len))) {
+			while(i--)
+				free(iov[i].iov_base);
+			io_uring_queue_exit(&uring.ring);
+			return -1;
+		}
+		s->index = i;
+	}
+	//  Registration may fail under RLIMIT_MEMLOCK, in which case the buffers are passed each time
+	uring.fixed = ! io_uring_register_buffers(&uring.ring, iov, URING_BUFFERS << 1);
+	uring.inOffset = uringOffset(inputFd);
+	uring.inDepth = 0 > uring.inOffset ? 1 : URING_BUFFERS;
+	uring.outOffset = uringOffset(STDOUT_FILENO);
+	uring.outDepth = 0 > uring.outOffset ? 1 : URING_BUFFERS - 1;
+	in->pos = in->end = (const unsigned char *)uring.in->buf + URING_MARGIN;
+	in->refill = uringRefill;
+	size_t size = out->end - out->buf;
+	out->buf = out->pos = uring.out->buf;
+	out->end = out->buf + size;
+	out->flush = uringFlush;
+	out->write = NULL;
+	return 0;
+}
+
+//  Wait for the last writes, and leave stdout positioned after them as write() would
+static int uringFinish(void)
+{
+	if(uringWaitWrites(0))
+		return -1;
+	if(0 <= uring.outOffset && 0 > lseek(STDOUT_FILENO, uring.outOffset, SEEK_SET))
+		return -1;
+	return 0;
+}
+#endif
+
+//  Parallel escaping of null separated input.  Every string is escaped independently, so the
+// input is cut into blocks at null characters, each block is split into pieces at null
+// characters, and each piece is escaped by its own thread into its own buffer.  A piece that
+// ends with a null produces output ending with the -z terminator, which is also the -z
+// separator, so only the space separator has to be added between pieces.  While one block is
+// being escaped, the output of the previous block is written and the next block is read.  A
+// streamed string too long to fit in a block, such as in input without nulls, ends the parallel
+// escaping, and it and the rest of the input are escaped as they are read, in a single thread.
+#define MAXIMUM_THREADS 256
+#define PIECE_SIZE (1024 * 1024)
+
+struct piece {
+	pthread_t thread;
+	int started;
+	const printfq_opts * opts;
+	const unsigned char * start;
+	printfq_input in;
+	printfq_output out;
+	int error;
+	//  Whether the library counted any string, which it does not for one that cannot be decoded
+	// at its very start
+	unsigned counted;
+};
+
+struct blockReader {
+	//  Mapped input, or a pair of alternating buffers for streamed input
+	int stream;
+	const unsigned char * pos;
+	const unsigned char * end;
+	unsigned char * buf[2];
+	size_t cap[2];
+	unsigned which;
+	//  The unterminated string at the end of the last streamed block
+	const unsigned char * tail;
+	size_t tailSize;
+	int eof;
+	//  Set when a streamed block grew to its limit without a null character
+	int unsplit;
+};
+
+//  Keep the whole of the output in memory
+static int growFlush(printfq_output * out)
+{
+	if(out->pos != out->end)
+		return 0;
+	size_t used = out->pos - out->buf;
+	size_t size = (out->end - out->buf) << 1;
+	char * buf = realloc(out->buf, size);
+	if(! buf)
+		return -1;
+	out->buf = buf;
+	out->pos = buf + used;
+	out->end = buf + size;
+	return 0;
+}
+
+static void * escapePiece(void * arg)
+{
+	struct piece * p = arg;
+	size_t strings = p->out.stats.strings;
+	p->out.pos = p->out.buf;
+	p->error = transform(p->opts, &p->in, &p->out) ? errno : 0;
+	p->counted = strings != p->out.stats.strings;
+	return NULL;
+}
+
+//  Find the end of the string containing ptr[-1]
+static const unsigned char * stringEnd(const unsigned char * ptr, const unsigned char * end)
+{
+	const unsigned char * nul = memchr(ptr - 1, 0, end - (ptr - 1));
+	return nul ? nul + 1 : end;
+}
+
+//  Get the next block of about size bytes that ends after a null or at the end of the input.
+// Returns the size of the block, which is 0 at the end of the input, or -1 on error.  A streamed
+// block grows until it has a null, but to no more than 4 times size, after which it is returned as
+// it is with unsplit set, and the rest of the input is left unread.
+static ssize_t nextBlock(struct blockReader * r, const unsigned char ** block, size_t size)
+{
+	if(! r->stream) {
+		*block = r->pos;
+		if(r->pos == r->end)
+			return 0;
+		r->pos = size < (size_t)(r->end - r->pos) ? stringEnd(r->pos + size, r->end) : r->end;
+		return r->pos - *block;
+	}
+	unsigned k = r->which ^= 1;
+	if(r->cap[k] < r->tailSize + size) {
+		unsigned char * buf = realloc(r->buf[k], r->tailSize + size);
+		if(! buf)
+			return -1;
+		r->buf[k] = buf;
+		r->cap[k] = r->tailSize + size;
+	}
+	size_t used = r->tailSize;
+	memcpy(r->buf[k], r->tail, used);
+	for(;;) {
+		while(! r->eof && used < r->cap[k]) {
+			ssize_t rc = read(inputFd, r->buf[k] + used, r->cap[k] - used);
+			if(0 < rc) {
+				used += rc;
+				inputBytes += rc;
+			}
+			else if(! rc)
+				r->eof = 1;
+			else if(EINTR != errno)
+				return -1;
+		}
+		const unsigned char * nul;
+		*block = r->buf[k];
+		if(r->eof) {
+			r->tailSize = 0;
+			return used;
+		}
+		if((nul = memrchr(r->buf[k], 0, used))) {
+			r->tail = nul + 1;
+			r->tailSize = used - (r->tail - r->buf[k]);
+			return r->tail - r->buf[k];
+		}
+		if(r->cap[k] >= size << 2) {
+			r->unsplit = 1;
+			return used;
+		}
+		//  There is no null character yet, so grow the block until there is one
+		unsigned char * buf = realloc(r->buf[k], r->cap[k] << 1);
+		if(! buf)
+			return -1;
+		r->buf[k] = buf;
+		r->cap[k] <<= 1;
+	}
+}
+
+//  Split a block among threads and start them.  Returns the number of pieces started.
+static unsigned startPieces(struct piece * pieces, unsigned threads, const unsigned char * block,
+	size_t size)
+{
+	const unsigned char * end = block + size;
+	size_t pieceSize = (size + threads - 1) / threads;
+	unsigned n = 0;
+	do {
+		struct piece * p = pieces + n++;
+		p->in.pos = p->start = block;
+		p->in.end = block = pieceSize < (size_t)(end - block) ? stringEnd(block + pieceSize, end) : end;
+		if(! (p->started = ! pthread_create(&p->thread, NULL, escapePiece, p)))
+			escapePiece(p);
+	} while(block != end);
+	return n;
+}
+
+static void joinPieces(struct piece * pieces, unsigned n)
+{
+	for(unsigned i = 0; i < n; i++)
+		if(pieces[i].started)
+			pthread_join(pieces[i].thread, NULL);
+}
+
+//  Write the output of n pieces in order.  Returns 0 or an errno value.
+static int writePieces(struct piece * pieces, unsigned n, struct iovec * iov, unsigned separate,
+	unsigned * first)
+{
+	static char space[] = " ";
+	int iovcnt = 0;
+	int error = 0;
+	for(unsigned i = 0; i < n && ! error; i++) {
+		struct piece * p = pieces + i;
+		error = p->error;
+		//  A string that cannot be decoded at its very start ends the output without '' for
+		// it, but only the first string of all of the input knows that it is first.  The library
+		// does not count such a string, so a piece that counted none output only that ''.
+		if(EILSEQ == error && ! *first && ! p->counted && printfq_escape_stream == transform)
+			break;
+		if(separate && ! *first)
+			iov[iovcnt++] = (struct iovec){space, 1};
+		iov[iovcnt++] = (struct iovec){p->out.buf, p->out.pos - p->out.buf};
+		*first = 0;
+	}
+	if(writeAll(iov, iovcnt))
+		return errno;
+	return error;
+}
+
+//  Kept for --stats, which sums the counters of every piece at exit
+static struct piece * parallelPieces;
+static unsigned parallelPieceCount;
+
+//  Escape an unsplit block and the rest of the input with piece p, in this thread, straight to
+// stdout.  So that nothing has to be taken back after it is written, when the output so far is
+// not empty, the start of the block is first escaped on its own to find out whether it can be
+// decoded, as writePieces() does after the fact.  Returns 0 or an errno value.
+static int escapeUnsplit(struct piece * p, const unsigned char * block, size_t size,
+	unsigned separate, unsigned first)
+{
+	static char space[] = " ";
+	if(! first && printfq_escape_stream == transform) {
+		printfq_stats stats = p->out.stats;
+		p->in = (printfq_input){.pos = block, .end = block + (MB_LEN_MAX < size ? MB_LEN_MAX : size)};
+		escapePiece(p);
+		p->out.stats = stats;
+		if(EILSEQ == p->error && ! p->counted)
+			return EILSEQ;
+	}
+	if(separate && ! first && writeAll(&(struct iovec){space, 1}, 1))
+		return errno;
+	p->in = (printfq_input){.pos = block, .end = block + size, .refill = inputRefill};
+	p->out.pos = p->out.buf;
+	p->out.flush = stdoutFlush;
+	p->out.write = stdoutWrite;
+	return transform(p->opts, &p->in, &p->out) ? errno : 0;
+}
+
+static int escapeParallel(const printfq_opts * opts, printfq_input * in, unsigned threads)
+{
+	struct piece * pieces = calloc(threads << 1, sizeof(*pieces));
+	struct iovec * iov = malloc((threads << 1) * sizeof(*iov));
+	if(! pieces || ! iov)
+		return errno;
+	parallelPieces = pieces;
+	parallelPieceCount = threads << 1;
+	for(unsigned i = 0; i < threads << 1; i++) {
+		struct piece * p = pieces + i;
+		p->opts = opts;
+		if(! (p->out.buf = malloc(bufferSize)))
+			return errno;
+		p->out.end = p->out.buf + bufferSize;
+		p->out.flush = growFlush;
+	}
+	struct blockReader r = {.stream = NULL != in->refill, .pos = in->pos, .end = in->end};
+	const unsigned separate = ! (opts->flags & PRINTFQ_NULL_TERMINATED_OUTPUT);
+	const size_t blockSize = (size_t)threads * PIECE_SIZE;
+	unsigned first = 1;
+	unsigned set = 0;
+	unsigned count[2] = {0, 0};
+	const unsigned char * block;
+	ssize_t size = nextBlock(&r, &block, blockSize);
+	if(0 > size)
+		return errno;
+	if(r.unsplit)
+		return escapeUnsplit(pieces, block, size, separate, first);
+	//  Empty input is still escaped, as an empty string
+	count[0] = startPieces(pieces, size ? threads : 1, block, size);
+	int error;
+	do {
+		//  Write the previous block and read the next while this one is escaped
+		error = writePieces(pieces + (set ^ 1) * threads, count[set ^ 1], iov, separate, &first);
+		if(! error && 0 > (size = nextBlock(&r, &block, blockSize)))
+			error = errno;
+		joinPieces(pieces + set * threads, count[set]);
+		if(error) {
+			if(0 > size)
+				writePieces(pieces + set * threads, count[set], iov, separate, &first);
+			return error;
+		}
+		set ^= 1;
+		count[set] = size && ! r.unsplit ? startPieces(pieces + set * threads, threads, block, size) : 0;
+	} while(count[set]);
+	error = writePieces(pieces + (set ^ 1) * threads, count[set ^ 1], iov, separate, &first);
+	return error || ! r.unsplit ? error : escapeUnsplit(pieces + set * threads, block, size, separate,
+		first);
+}
+
+//  Parallel escaping of non-option arguments.  The arguments are split into runs of about the
+// same total size, one per thread, and each run is escaped from a null terminated copy of its
+// part of argv, as with argvRefill().  Every argument ends with a null, so the output of the
+// runs is joined the same way as the pieces of a block of stdin.
+#define ARGUMENT_PIECE_SIZE (64 * 1024)
+
+static int escapeArguments(const printfq_opts * opts, char ** argv, unsigned threads)
+{
+	size_t total = 0;
+	unsigned count = 0;
+	for(; argv[count]; count++)
+		total += strlen(argv[count]) + 1;
+	size_t n = (total + ARGUMENT_PIECE_SIZE - 1) / ARGUMENT_PIECE_SIZE;
+	if(n > threads)
+		n = threads;
+	if(n > count)
+		n = count;
+	struct piece * pieces = calloc(n, sizeof(*pieces));
+	struct iovec * iov = malloc((n << 1) * sizeof(*iov));
+	char ** slices = malloc((count + n) * sizeof(*slices));
+	if(! pieces || ! iov || ! slices)
+		return errno;
+	parallelPieces = pieces;
+	parallelPieceCount = n;
+	const size_t pieceSize = (total + n - 1) / n;
+	char ** slice = slices;
+	unsigned started = 0;
+	for(unsigned idx = 0; idx < count; started++) {
+		struct piece * p = pieces + started;
+		p->opts = opts;
+		if(! (p->out.buf = malloc(bufferSize)))
+			return errno;
+		p->out.end = p->out.buf + bufferSize;
+		p->out.flush = growFlush;
+		p->in.refill = argvRefill;
+		p->in.handle = slice;
+		p->start = (const unsigned char *)argv[idx];
+		//  The last run takes whatever is left
+		size_t size = 0;
+		do
+			size += strlen(*slice++ = argv[idx++]) + 1;
+		while(idx < count && (size < pieceSize || started + 1 == n));
+		*slice++ = NULL;
+		if(! (p->started = 1 < n && ! pthread_create(&p->thread, NULL, escapePiece, p)))
+			escapePiece(p);
+	}
+	joinPieces(pieces, started);
+	unsigned first = 1;
+	return writePieces(pieces, started, iov, ! (opts->flags & PRINTFQ_NULL_TERMINATED_OUTPUT), &first);
+}
+
+//  --stats.  The library counts as it escapes into each output, and those counters are summed
+// here.  The report is written to stderr at exit, as text or as JSON.
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+static unsigned statsFormat;
+static printfq_stats totalStats;
+static printfq_cache_stats cacheStats;
+static struct timespec startTime;
+
+static void addStats(const printfq_stats * stats)
+{
+	//  Every counter is a size_t
+	size_t * total = (size_t *)&totalStats;
+	const size_t * add = (const size_t *)stats;
+	for(size_t idx = 0; idx < sizeof(totalStats) / sizeof(size_t); idx++)
+		total[idx] += add[idx];
+}
+
+static double secondsOf(struct timeval tv)
 {
-	setvbuf(stdout, stdoutBuffer, _IOFBF, sizeof(stdoutBuffer));
-	setvbuf(stdin, stdinBuffer, _IOFBF, sizeof(stdinBuffer));
-	//  These are characters that must always be escaped or quoted
-	// to avoid interpretation by the shell.  See
-	// https://pubs.opengroup.org/onlinepubs/9699919799/utilities/V3_chap02.html#tag_18_02
-	// = and % have been omitted here since, at least as an argument, it does not appear to be
-	// possible to mis-interpret them.  The tilde (~) has specific handling.  There is room
-	// for improvement with the other contextual escapes: *, ?, [, and #.
-	// ^ is escaped in case the escaped string is placed inside a bracket expansion (bash
-	// recognizes it).  Perhaps an argument indicating that the output will not be used as a
-	// test argument would make sense?  
-	static const char shControlChars[] = {
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 1, 1, 0, 0, 0, 0, 0,	// tab, newline
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 0, 0, 0,
-		1, 1, 1, 1, 1, 0, 1, 1, // space ! " # $ & '
-		1, 1, 1, 0, 1, 0, 0, 0, // ( ) * comma
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 1, 1, 0, 1, 1, // ; < > ?
-
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 1, 1, 1, 1, 0, // [ \ ] ^
-		1, 0, 0, 0, 0, 0, 0, 0, // `
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 0, 0, 0, 0, 0,
-		0, 0, 0, 1, 1, 1, 0, 0  // { | }
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void reportStats(void)
+{
+	struct timespec now;
+	struct rusage usage;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &usage);
+	for(unsigned idx = 0; idx < parallelPieceCount; idx++)
+		addStats(&parallelPieces[idx].out.stats);
+	const struct {
+		const char * name;
+		size_t value;
+	} counters[] = {
+		{"strings", totalStats.strings},
+		{"input_bytes", inputBytes},
+		{"output_bytes", outputBytes},
+		{"unquoted_output_bytes", outputBytes - totalStats.quotedBytes},
+		{"quoted_segments", totalStats.quotedSegments},
+		{"quoted_bytes", totalStats.quotedBytes},
+		{"octal_escapes", totalStats.octalEscapes},
+		{"unicode_escapes", totalStats.unicodeEscapes},
+		{"long_unicode_escapes", totalStats.longUnicodeEscapes},
+		{"ansi_escapes", totalStats.ansiEscapes},
+		{"invalid_bytes", totalStats.invalidBytes},
+		{"flushes", totalStats.flushes},
+		{"cache_hits", cacheStats.hits},
+		{"cache_misses", cacheStats.misses},
+		{"cache_evictions", cacheStats.evictions}
+	};
+	const struct {
+		const char * name;
+		double value;
+	} times[] = {
+		{"wall_seconds", now.tv_sec - startTime.tv_sec + (now.tv_nsec - startTime.tv_nsec) / 1e9},
+		{"user_seconds", secondsOf(usage.ru_utime)},
+		{"sys_seconds", secondsOf(usage.ru_stime)}
 	};
-	//  These are non-printable characters that have defined escapes inside $'' quoting,
-	// and whose escapes are the indicated letters.
-	static const char ansiEscapes[] = {
-		0,   0,   0,   0,   0,   0,   0,   'a', // bell
-		// backspace, tab, newline, vertical tab, form feed, carriage return
-		'b', 't', 'n', 'v', 'f', 'r', 0,   0,
-		0,   0,   0,   0,   0,   0,   0,   0,
-		0,   0,   0, 'E'  // escape
+	const char * separator = "{";
+	for(size_t idx = 0; idx < sizeof(counters) / sizeof(*counters); idx++, separator = ",")
+		if(STATS_JSON == statsFormat)
+			fprintf(stderr, "%s\"%s\":%zu", separator, counters[idx].name, counters[idx].value);
+		else
+			fprintf(stderr, "%-22s %zu\n", counters[idx].name, counters[idx].value);
+	for(size_t idx = 0; idx < sizeof(times) / sizeof(*times); idx++)
+		if(STATS_JSON == statsFormat)
+			fprintf(stderr, ",\"%s\":%.6f", times[idx].name, times[idx].value);
+		else
+			fprintf(stderr, "%-22s %.6f\n", times[idx].name, times[idx].value);
+#ifdef PRINTFQ_TRACE
+	//  Time in the library, summed across threads, and the histogram's buckets that are not empty
+	printfq_trace trace;
+	printfq_trace_get(&trace);
+	const struct {
+		const char * name;
+		double value;
+	} phases[] = {
+		{"trace_calls", trace.calls},
+		{"library_seconds", trace.totalNs / 1e9},
+		{"read_seconds", trace.readNs / 1e9},
+		{"write_seconds", trace.writeNs / 1e9},
+		{"classify_seconds", trace.classifyNs / 1e9},
+		{"engine_seconds", (trace.totalNs - trace.readNs - trace.writeNs - trace.classifyNs) / 1e9}
 	};
-	//  The \E escape for the escape character (0x1B) is recognized by bash, ksh, and zsh,
-	// but it is not recognized by busybox sh.  This limit will be increased when the -u
-	// option is specified.
-	unsigned ansiEscapesLimit = 14;
-	int (* iswprintFn)(wint_t c) = iswprint;
-	unsigned disableCQuoting = 0;
-	unsigned useUnicodeEscapes = 0;
-	unsigned flushArguments = 0;
-	unsigned ignoreNullInput = 0;
-	unsigned nullTerminatedOutput = 0;
+	for(size_t idx = 0; idx < sizeof(phases) / sizeof(*phases); idx++)
+		if(STATS_JSON == statsFormat)
+			fprintf(stderr, ",\"%s\":%.*f", phases[idx].name, idx ? 6 : 0, phases[idx].value);
+		else
+			fprintf(stderr, "%-22s %.*f\n", phases[idx].name, idx ? 6 : 0, phases[idx].value);
+	separator = STATS_JSON == statsFormat ? ",\"string_ns\":{" : "";
+	for(unsigned idx = 0; idx < PRINTFQ_TRACE_BUCKETS; idx++)
+		if(trace.stringNs[idx]) {
+			if(STATS_JSON == statsFormat)
+				fprintf(stderr, "%s\"%llu\":%llu", separator, idx ? 1ULL << idx : 0, trace.stringNs[idx]);
+			else
+				fprintf(stderr, "string_ns>=%-11llu %llu\n", idx ? 1ULL << idx : 0, trace.stringNs[idx]);
+			separator = ",";
+		}
+	if(STATS_JSON == statsFormat)
+		fputs(',' == *separator ? "}" : ",\"string_ns\":{}", stderr);
+#endif
+	if(STATS_JSON == statsFormat)
+		fputs("}\n", stderr);
+}
+
+//  Server mode.  Each request is a 4 byte flags value holding PRINTFQ_* option flags, a 4 byte
+// length, and that many bytes of input, which are escaped as though they were all of stdin.
+// Each response is a 4 byte status, which is 0 or an errno value, a 4 byte length, and that
+// many bytes of output.  Integers are little endian.  Responses are held until there is no
+// more input waiting to be read, or until they fill the buffer.
+#define SERVER_FLAGS (PRINTFQ_ESCAPE_MORE | PRINTFQ_ESCAPE_INVISIBLE | PRINTFQ_MINIMAL | \
+	PRINTFQ_IGNORE_NULL_INPUT | PRINTFQ_UNICODE_ESCAPES | PRINTFQ_NULL_TERMINATED_OUTPUT | \
+	PRINTFQ_OPTIMIZE_OUTPUT_LENGTH)
+
+struct serverInput {
+	unsigned char * buf;
+	size_t cap;
+	unsigned char * pos;
+	unsigned char * end;
+	printfq_output * out;
+};
+
+static uint32_t getLe32(const unsigned char * p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void putLe32(char * p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static int flushResponses(printfq_output * out)
+{
+	struct iovec iov = {out->buf, out->pos - out->buf};
+	out->pos = out->buf;
+	return writeAll(&iov, 1);
+}
+
+//  Read at least size bytes into the input buffer, growing it if needed, and write out the
+// pending responses before waiting for input.  Returns 0, 1 at the end of the input, or -1.
+static int serverFill(struct serverInput * in, size_t size)
+{
+	size_t pending = in->end - in->pos;
+	if(pending >= size)
+		return 0;
+	if(size > in->cap) {
+		//  Grow the buffer to hold the whole request
+		unsigned char * buf = malloc(size);
+		if(! buf)
+			return -1;
+		memcpy(buf, in->pos, pending);
+		free(in->buf);
+		in->buf = buf;
+		in->cap = size;
+	}
+	else
+		memmove(in->buf, in->pos, pending);
+	in->pos = in->buf;
+	in->end = in->pos + pending;
+	do {
+		struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+		if(in->out->pos != in->out->buf && 1 != poll(&pfd, 1, 0) && flushResponses(in->out))
+			return -1;
+		ssize_t rc = read(STDIN_FILENO, in->end, in->cap - (in->end - in->pos));
+		if(0 < rc) {
+			in->end += rc;
+			inputBytes += rc;
+		}
+		else if(! rc)
+			return 1;
+		else if(EINTR != errno)
+			return -1;
+	} while((size_t)(in->end - in->pos) < size);
+	return 0;
+}
+
+//  Consume size bytes of input without keeping them, for a request that is too large to be held
+// in memory.  Returns 0, 2 if the input ends first, or -1.
+static int serverSkip(struct serverInput * in, size_t size)
+{
+	int rc;
+	while((size_t)(in->end - in->pos) < size) {
+		size -= in->end - in->pos;
+		in->pos = in->end = in->buf;
+		if((rc = serverFill(in, 1)))
+			return 0 > rc ? rc : 2;
+	}
+	in->pos += size;
+	return 0;
+}
+
+//  Make room for size more bytes of output, growing the buffer as growFlush() does
+static int reserveOutput(printfq_output * out, size_t size)
+{
+	size_t used = out->pos - out->buf;
+	size_t cap = out->end - out->buf;
+	if(cap - used >= size)
+		return 0;
+	while(cap - used < size)
+		if((cap <<= 1) > SIZE_MAX >> 1) {
+			errno = ENOMEM;
+			return -1;
+		}
+	char * buf = realloc(out->buf, cap);
+	if(! buf)
+		return -1;
+	out->buf = buf;
+	out->pos = buf + used;
+	out->end = buf + cap;
+	return 0;
+}
+
+//  Successful responses are kept in a cache of cacheSize bytes, if it is not 0.  Requests with
+// more than maxRequest bytes of input are discarded as they are read and answered with EMSGSIZE.
+static int serve(unsigned charset, size_t cacheSize, size_t maxRequest)
+{
+	struct serverInput in = {.buf = malloc(bufferSize), .cap = bufferSize};
+	char * buf = malloc(bufferSize);
+	printfq_output out = {.buf = buf, .pos = buf, .end = buf + bufferSize, .flush = growFlush};
+	printfq_cache * cache = cacheSize ? printfq_cache_new(cacheSize) : NULL;
+	if(! in.buf || ! out.buf || (cacheSize && ! cache))
+		return EX_OSERR;
+	in.pos = in.end = in.buf;
+	in.out = &out;
+	int rc;
+	while(! (rc = serverFill(&in, 8))) {
+		uint32_t flags = getLe32(in.pos);
+		size_t size = getLe32(in.pos + 4);
+		int status = size > maxRequest ? EMSGSIZE : flags & ~SERVER_FLAGS ? EINVAL : 0;
+		printfq_opts opts = {.flags = flags, .charset = charset};
+		printfq_input req = {.pos = NULL};
+		if(EMSGSIZE == status) {
+			if((rc = serverSkip(&in, size + 8)))
+				break;
+		}
+		else if((rc = serverFill(&in, size + 8)))
+			break;
+		else {
+			req = (printfq_input){.pos = in.pos + 8, .end = in.pos + 8 + size};
+			in.pos += size + 8;
+		}
+		//  Reserve the header, escape after it, then fill it in
+		if(8 > out.end - out.pos && flushResponses(&out))
+			return EX_IOERR;
+		size_t header = out.pos - out.buf;
+		out.pos += 8;
+		const char * cached = NULL;
+		size_t length;
+		if(! status && cache && (cached = printfq_cache_lookup(cache, (const char *)req.end - size,
+			size, &opts, &length)))
+		{
+			if(reserveOutput(&out, length))
+				return EX_OSERR;
+			memcpy(out.pos, cached, length);
+			out.pos += length;
+		}
+		else if(! status && transform(&opts, &req, &out))
+			status = errno;
+		if(status && EILSEQ != status && EINVAL != status && EMSGSIZE != status)
+			return EX_OSERR;
+		if(cache && ! cached && ! status && printfq_cache_insert(cache, (const char *)req.end - size,
+			size, &opts, out.buf + header + 8, out.pos - out.buf - header - 8))
+			return EX_OSERR;
+		putLe32(out.buf + header, status);
+		putLe32(out.buf + header + 4, out.pos - out.buf - header - 8);
+		if((size_t)(out.pos - out.buf) >= bufferSize && flushResponses(&out))
+			return EX_IOERR;
+	}
+	addStats(&out.stats);
+	if(cache)
+		cacheStats = *printfq_cache_get_stats(cache);
+	if(out.pos != out.buf && flushResponses(&out))
+		return EX_IOERR;
+	if(0 > rc)
+		return ENOMEM == errno ? EX_OSERR : EX_IOERR;
+	//  The input must end between requests
+	return 1 == rc && in.pos == in.end ? 0 : EX_PROTOCOL;
+}
+
+//  --index.  The file starts with INDEX_MAGIC and the interval, followed by an entry for the
+// first string and every indexInterval'th string after it.  Each entry is where its string starts
+// in the input and in the output, as the differences from the previous entry, or from 0 for the
+// first.  Numbers are unsigned LEB128:  7 bits at a time, least significant first, with the high
+// bit set on all but the last byte.
+#define INDEX_MAGIC "PFQI\1"
+
+static FILE * indexFile;
+static unsigned long indexInterval = 1;
+static size_t indexStrings;
+//  Where the current string started, and the offsets in the last entry
+static size_t indexInput;
+static size_t indexOutput;
+static size_t indexedInput;
+static size_t indexedOutput;
+
+static void putVarint(size_t v, FILE * f)
+{
+	for(; 0x7F < v; v >>= 7)
+		putc((v & 0x7F) | 0x80, f);
+	putc(v, f);
+}
+
+//  Called by the library at the end of each string, for --index and --checkpoint
+static void recordString(printfq_output * out, const printfq_input * in)
+{
+	//  The next string starts after this one's null terminator and its single byte delimiter.  Every
+	// refill has added what it read to inputBytes.
+	size_t input = inputBytes - (in->end - in->pos);
+	size_t output = out->stats.writtenBytes + (out->pos - out->buf) + 1;
+	if(indexFile) {
+		if(! (indexStrings++ % indexInterval)) {
+			putVarint(indexInput - indexedInput, indexFile);
+			putVarint(indexOutput - indexedOutput, indexFile);
+			indexedInput = indexInput;
+			indexedOutput = indexOutput;
+		}
+		indexInput = input;
+		indexOutput = output;
+	}
+	checkpointInput = input;
+	checkpointOutput = output;
+}
+
+static int openIndex(const char * path)
+{
+	if(! (indexFile = fopen(path, "w")))
+		return -1;
+	fputs(INDEX_MAGIC, indexFile);
+	putVarint(indexInterval, indexFile);
+	return 0;
+}
+
+//  Returns rc, or EX_IOERR if the index could not be written
+static int closeIndex(int rc)
+{
+	if(indexFile && (ferror(indexFile) | fclose(indexFile))) {
+		perror("printfq: index");
+		return rc ? rc : EX_IOERR;
+	}
+	return rc;
+}
+
+//  Count the output for --measure instead of writing it
+static size_t measuredLength;
+
+static int measureFlush(printfq_output * out)
+{
+	measuredLength += out->pos - out->buf;
+	out->pos = out->buf;
+	return 0;
+}
+
+static int measureWrite(printfq_output * out, const void * ptr, size_t size)
+{
+	measuredLength += (out->pos - out->buf) + size;
+	out->pos = out->buf;
+	return 0;
+}
+
+//  Parse a buffer size with an optional K or M suffix.  Returns 0 if the size is invalid.
+static size_t parseSize(const char * s)
+{
+	char * end;
+	errno = 0;
+	unsigned long long size = strtoull(s, &end, 10);
+	if(errno || end == s || '-' == *s)
+		return 0;
+	unsigned shift = 0;
+	switch(*end) {
+	case 'k':
+	case 'K':
+		shift = 10;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		shift = 20;
+		end++;
+		break;
+	}
+	if(*end || size > (SIZE_MAX >> 1) >> shift || MINIMUM_BUFFER_SIZE > size << shift)
+		return 0;
+	return size << shift;
+}
+
+#ifdef PRINTFQ_STARTUP
+//  PRINTFQ_STARTUP builds decide the character set of the C and UTF-8 locales from the
+// environment, in the order that setlocale() would look, so that no locale data is loaded for
+// them.  A UTF-8 locale is taken at its name, even where setlocale() would fall back to C because
+// it is not installed.  Returns the character set, or -1 if it is left to setlocale().
+static int environmentCharset(void)
+{
+	static const char * const variables[] = {"LC_ALL", "LC_CTYPE", "LANG"};
+	const char * name = NULL;
+	for(unsigned i = 0; i < sizeof(variables) / sizeof(*variables) && ! (name && *name); i++)
+		name = getenv(variables[i]);
+	if(! name || ! *name || ! strcmp("C", name) || ! strcmp("POSIX", name))
+		return PRINTFQ_CHARSET_ASCII;
+	const char * codeset = strchr(name, '.');
+	if(! codeset || strchr(name, '/'))
+		return -1;
+	const char * utf8 = "utf8";
+	for(codeset++; *codeset && '@' != *codeset; codeset++)
+		if('-' != *codeset && (! *utf8 || tolower((unsigned char)*codeset) != *utf8++))
+			return -1;
+	return *utf8 ? -1 : PRINTFQ_CHARSET_UTF8;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	unsigned flags = 0;
+	const char * inputFile = NULL;
+	const char * indexPath = NULL;
+	const char * checkpointPath = NULL;
+	unsigned resume = 0;
+	unsigned threads = 1;
+	unsigned server = 0;
+	size_t cacheSize = 0;
+	size_t maxRequest = 0;
+	unsigned long shard = 0;
+	unsigned long shards = 0;
+	int shardDelimit = 0;
+	unsigned measure = 0;
+	size_t flushSize = 0;
+	unsigned ioUring = 0;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
 	{
 		int currentoption; // for getopt parsing
 		// Long option parsing vars
 		static const struct option longopts[] = {
 			// {.name, .has_arg, .flag, .val}
 			{"help", no_argument, NULL, '$'},
+			{"buffer-size", required_argument, NULL, '#'},
+			{"cache", required_argument, NULL, '+'},
+			{"checkpoint", required_argument, NULL, '{'},
+			{"flush-delay", required_argument, NULL, '@'},
+			{"flush-idle", no_argument, NULL, '!'},
+			{"flush-size", required_argument, NULL, '^'},
+			{"index", required_argument, NULL, '['},
+			{"index-interval", required_argument, NULL, ']'},
+			{"input", required_argument, NULL, '<'},
+			{"io", required_argument, NULL, '|'},
+			{"max-request", required_argument, NULL, '>'},
+			{"measure", no_argument, NULL, '='},
+			{"resume", no_argument, NULL, '}'},
+			{"server", no_argument, NULL, '&'},
+			{"shard", required_argument, NULL, '/'},
+			{"stats", optional_argument, NULL, '*'},
+			{"decode", no_argument, NULL, 'd'},
 			{"escape-more", no_argument, NULL, 'e'},
 			{"flush-arguments", no_argument, NULL, 'f'},
 			{"escape-invisible", no_argument, NULL, 'i'},
+			{"threads", required_argument, NULL, 'j'},
 			{"minimal", no_argument, NULL, 'm'},
 			{"ignore-null-input", no_argument, NULL, 'n'},
+			{"optimize-output-length", no_argument, NULL, 'o'},
 			{"unicode-escapes", no_argument, NULL, 'u'},
 			{"null-terminated-output", no_argument, NULL, 'z'},
 			{"version", no_argument, NULL, '%'},
 			{0, 0, 0, 0}
 		};
-		while(-1 != (currentoption = getopt_long(argc, argv, ":efimnuz", longopts, &currentoption)))
+		while(-1 != (currentoption = getopt_long(argc, argv, ":defij:mnouz", longopts, &currentoption)))
 		{
 			switch(currentoption) {
 			case '$':
@@ -184,6 +1451,12 @@ int main(int argc, char **argv)
 					"suitable for processing as UTF-8.  The `locale -c charmap` command can be used\n"
 					"to check what encoding a particular locale uses\n\n"
 					"OPTIONS:\n"
+					" -d, --decode\n"
+					"    Instead of escaping, parse input in the form that this outputs into the\n"
+					"  words that a shell would split it into, and output each word, unescaped and\n"
+					"  null terminated.  Only the quoting and escapes that this outputs are\n"
+					"  accepted.  The options that change how strings are escaped have no effect\n"
+					"  with this\n"
 					" -e, --escape-more\n"
 					"    Escape Unicode code points other than the ASCII space character (0x20)\n"
 					"  that, by themselves, have no glyph.  This includes other space characters and\n"
@@ -200,6 +1473,12 @@ int main(int argc, char **argv)
 					"  code points such as zero width spaces, but not other space characters.  This\n"
 					"  option's implementation is not exhaustive and cannot guarantee that unescaped\n"
 					"  characters will render.  The --minimal option supercedes this option\n"
+					" -j, --threads=N\n"
+					"    Escape null terminated strings from stdin, or non-option arguments, using N\n"
+					"  threads, or one thread per processor if N is 0.  The output is the same as\n"
+					"  with one thread.  This option has no effect with --flush-arguments, --index,\n"
+					"  or --measure, or for stdin, with --ignore-null-input, the other --flush\n"
+					"  options, or --io=uring\n"
 					" -m, --minimal\n"
 					"    Do not use ANSI-C style quoting ($'') or its escapes for non-printable\n"
 					"  characters.  This will produce machine readable output that can be processed\n"
@@ -208,8 +1487,11 @@ int main(int argc, char **argv)
 					" -n, --ignore-null-input\n"
 					"    Ignore null characters read over stdin and treat all streamed input as a\n"
 					"  single string.  This option has no effect when there are non-option arguments\n"
-					//" -o, --optimize-output-length\n"
-					//"    Attempt to produce shorter output by processing the input multiple times\n"
+					" -o, --optimize-output-length\n"
+					"    Produce the shortest output possible by choosing between bare, '', and $''\n"
+					"  quoting for each part of each string, and by escaping special characters\n"
+					"  outside of quotes with a backslash.  This option has no effect in locales\n"
+					"  that use neither ASCII nor UTF-8 encoding\n"
 					" -u, --unicode-escapes\n"
 					"    Escape non-printable, yet valid, Unicode code points that are greater than\n"
 					"  127 using $'\\uXXXX' or $'\\UXXXXXXXX' syntax, instead of escaping individual\n"
@@ -226,6 +1508,67 @@ int main(int argc, char **argv)
 					"  specified, or if the input comes from non-option arguments\n"
 					" --\n"
 					"    End of input.  Use this to protect input arguments from option processing\n"
+					" --buffer-size=SIZE\n"
+					"    Read and write SIZE bytes at a time.  SIZE is in bytes, or in KiB or MiB\n"
+					"  with a K or M suffix.  The default is 128K\n"
+					" --cache=SIZE\n"
+					"    With --server, keep up to SIZE bytes of requests and their responses, and\n"
+					"  answer repeated requests from them.  SIZE is as with --buffer-size\n"
+					" --checkpoint=FILE\n"
+					"    Save where to resume from to FILE as the output is written, at the end of a\n"
+					"  string at least every --buffer-size bytes of output, and at the end of the\n"
+					"  input.  This option has no effect with --measure or non-option arguments\n"
+					" --flush-delay=USEC\n"
+					"    Write buffered output once it has been pending for USEC microseconds, even\n"
+					"  while more input keeps arriving.  This is checked whenever stdin is read\n"
+					" --flush-idle\n"
+					"    Write buffered output whenever reading more of stdin would block.  Along\n"
+					"  with --flush-delay and --flush-size, this keeps the output of trickling input\n"
+					"  timely without a write for every string, as with --flush-arguments\n"
+					" --flush-size=SIZE\n"
+					"    Write buffered output once SIZE bytes are pending, rather than when the\n"
+					"  buffer is full.  SIZE is as with --buffer-size\n"
+					" --index=FILE\n"
+					"    Write where each string starts in the input and in the output to FILE, so\n"
+					"  that a string's output can be found without scanning for delimiters.  See the\n"
+					"  README for the format.  This option has no effect with --server\n"
+					" --index-interval=N\n"
+					"    Only index the first string and every Nth string after it.  The default is 1\n"
+					" --input=FILE\n"
+					"    Read input from FILE instead of stdin.  This option has no effect when there\n"
+					"  are non-option arguments\n"
+					" --io=METHOD\n"
+					"    Read stdin and write stdout with METHOD, which is read, the default, or\n"
+					"  uring.  uring keeps reads and writes in flight with io_uring while escaping.\n"
+					"  It falls back to read when io_uring is not supported or was not built in,\n"
+					"  and has no effect with --flush-delay, --flush-idle, --index, --measure, or\n"
+					"  non-option arguments\n"
+					" --max-request=SIZE\n"
+					"    With --server, answer a request of more than SIZE bytes of input with\n"
+					"  EMSGSIZE, discarding its input as it is read instead of holding it in memory.\n"
+					"  SIZE is as with --buffer-size.  The default is 4 times the buffer size\n"
+					" --measure\n"
+					"    Instead of the escaped output, print its length in bytes followed by a\n"
+					"  newline\n"
+					" --resume\n"
+					"    Continue from the --checkpoint FILE, if it has been saved, by seeking or\n"
+					"  skipping the input to it and truncating a regular output file to it.  The\n"
+					"  output must be opened without truncating it, as with >> or 1<>\n"
+					" --server\n"
+					"    Read length prefixed requests from stdin and write length prefixed responses\n"
+					"  to stdout until the end of the input.  See the README for the protocol\n"
+					" --shard=I/N\n"
+					"    Divide the input, which must be a regular file, into N byte ranges of the\n"
+					"  same size, and only escape the strings that start in the Ith, counting from\n"
+					"  1.  The output of shards 1 through N concatenates to the output for all of\n"
+					"  the input.  This option has no effect with --ignore-null-input or non-option\n"
+					"  arguments, and --checkpoint has no effect with it\n"
+					" --stats[=FORMAT]\n"
+					"    At exit, write counts of the strings, input and output bytes, quoted\n"
+					"  segments, each kind of escape, invalid UTF-8 bytes, flushes, and --cache hits,\n"
+					"  misses, and evictions to stderr, along with the wall, user, and system time.\n"
+					"  Invalid UTF-8 bytes are only counted in a UTF-8 locale without --minimal.\n"
+					"  FORMAT is text, the default, or json\n"
 					" --help\n"
 					"    This output\n"
 					" --version\n"
@@ -236,33 +1579,154 @@ int main(int argc, char **argv)
 				);
 				exit(0);
 				break;
+			case '#':
+				if(! (bufferSize = parseSize(optarg))) {
+					fprintf(stderr, "Invalid buffer size: %s\n", optarg);
+					return EX_USAGE;
+				}
+				break;
+			case '+':
+				if(! (cacheSize = parseSize(optarg))) {
+					fprintf(stderr, "Invalid cache size: %s\n", optarg);
+					return EX_USAGE;
+				}
+				break;
+			case '>':
+				if(! (maxRequest = parseSize(optarg))) {
+					fprintf(stderr, "Invalid maximum request size: %s\n", optarg);
+					return EX_USAGE;
+				}
+				break;
+			case '@': {
+				char * end;
+				errno = 0;
+				flushDelay = strtoul(optarg, &end, 10);
+				if(errno || *end || end == optarg || '-' == *optarg || ! flushDelay) {
+					fprintf(stderr, "Invalid flush delay: %s\n", optarg);
+					return EX_USAGE;
+				}
+				break;
+			}
+			case '!':
+				flushIdle = 1;
+				break;
+			case '^':
+				if(! (flushSize = parseSize(optarg))) {
+					fprintf(stderr, "Invalid flush size: %s\n", optarg);
+					return EX_USAGE;
+				}
+				break;
+			case '[':
+				indexPath = optarg;
+				break;
+			case ']': {
+				char * end;
+				errno = 0;
+				indexInterval = strtoul(optarg, &end, 10);
+				if(errno || *end || end == optarg || '-' == *optarg || ! indexInterval) {
+					fprintf(stderr, "Invalid index interval: %s\n", optarg);
+					return EX_USAGE;
+				}
+				break;
+			}
+			case '{':
+				checkpointPath = optarg;
+				break;
+			case '}':
+				resume = 1;
+				break;
+			case '<':
+				inputFile = optarg;
+				break;
+			case '|':
+				if(! strcmp("uring", optarg)) {
+					//  Without io_uring support, this is the same as read
+					#ifdef PRINTFQ_URING
+						ioUring = 1;
+					#endif
+				}
+				else if(strcmp("read", optarg)) {
+					fprintf(stderr, "Invalid I/O method: %s\n", optarg);
+					return EX_USAGE;
+				}
+				else
+					ioUring = 0;
+				break;
+			case '&':
+				server = 1;
+				break;
+			case '/': {
+				char * end;
+				shards = 0;
+				shard = strtoul(optarg, &end, 10);
+				if('/' == *end && isdigit((unsigned char)end[1]))
+					shards = strtoul(end + 1, &end, 10);
+				if(*end || '-' == *optarg || ! shard || shards < shard || MAXIMUM_SHARDS < shards) {
+					fprintf(stderr, "Invalid shard: %s\n", optarg);
+					return EX_USAGE;
+				}
+				break;
+			}
+			case '=':
+				measure = 1;
+				break;
+			case '*':
+				if(! optarg || ! strcmp("text", optarg))
+					statsFormat = STATS_TEXT;
+				else if(! strcmp("json", optarg))
+					statsFormat = STATS_JSON;
+				else {
+					fprintf(stderr, "Invalid stats format: %s\n", optarg);
+					return EX_USAGE;
+				}
+				break;
+			case 'd':
+				transform = printfq_decode_stream;
+				break;
 			case 'e':
-				iswprintFn = iswNotBlank;
+				flags |= PRINTFQ_ESCAPE_MORE;
 				break;
 			case 'f':
-				flushArguments = nullTerminatedOutput = 1;
+				flags |= PRINTFQ_FLUSH_ARGUMENTS | PRINTFQ_NULL_TERMINATED_OUTPUT;
 				break;
 			case 'i':
-				if(iswNotBlank != iswprintFn)
-					iswprintFn = iswprintExt;
+				flags |= PRINTFQ_ESCAPE_INVISIBLE;
+				break;
+			case 'j': {
+				char * end;
+				unsigned long n = strtoul(optarg, &end, 10);
+				if(*end || end == optarg || '-' == *optarg || MAXIMUM_THREADS < n) {
+					fprintf(stderr, "Invalid thread count: %s\n", optarg);
+					return EX_USAGE;
+				}
+				if(! (threads = n)) {
+					long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+					threads = 0 < cpus ? MAXIMUM_THREADS < cpus ? MAXIMUM_THREADS : cpus : 1;
+				}
 				break;
+			}
 			case 'm':
-				disableCQuoting = 1;
+				flags |= PRINTFQ_MINIMAL;
 				break;
 			case 'n':
-				ignoreNullInput = 1;
+				flags |= PRINTFQ_IGNORE_NULL_INPUT;
+				break;
+			case 'o':
+				flags |= PRINTFQ_OPTIMIZE_OUTPUT_LENGTH;
 				break;
 			case 'u':
-				useUnicodeEscapes = 1;
-				ansiEscapesLimit = sizeof(ansiEscapes);
+				flags |= PRINTFQ_UNICODE_ESCAPES;
 				break;
 			case 'z':
-				nullTerminatedOutput = 1;
+				flags |= PRINTFQ_NULL_TERMINATED_OUTPUT;
 				break;
 			case '%':
 				puts(PRINTFQ_VERSION_STRING_LONG);
 				exit(0);
 				break;
+			case ':':
+				fprintf(stderr, "Missing argument: %s\n", argv[optind-1]);
+				return EX_USAGE;
 			case '?':
 				if(0 == optopt)
 					fprintf(stderr, "Invalid option: %s\n", argv[optind-1]);
@@ -276,598 +1740,158 @@ int main(int argc, char **argv)
 			}
 		}
 	}
+	if(statsFormat)
+		atexit(reportStats);
+	printfq_opts opts;
+	#ifdef PRINTFQ_STARTUP
+	int charset = environmentCharset();
+	if(0 <= charset)
+		opts = (printfq_opts){.flags = flags, .charset = charset};
+	else
+	#endif
+	{
+		setlocale(LC_ALL, "");
+		printfq_opts_init(&opts, flags);
+	}
+	//  Decoded words are always null terminated, so they are joined as with -z
+	if(printfq_decode_stream == transform)
+		opts.flags |= PRINTFQ_NULL_TERMINATED_OUTPUT;
+	if(server)
+		return serve(opts.charset, cacheSize, maxRequest ? maxRequest : bufferSize << 2);
+	if(indexPath) {
+		if(openIndex(indexPath)) {
+			fprintf(stderr, "printfq: %s: %s\n", indexPath, strerror(errno));
+			return EX_CANTCREAT;
+		}
+		//  The offsets come from the order that strings are escaped in, and what has been read
+		threads = 1;
+		ioUring = 0;
+	}
+	printfq_input in = {.refill = inputRefill};
 	if(optind < argc) {
-		//  Fork and use the stream processing implementation for the arguments
-		ignoreNullInput = 0;
-		int streamPipe[2];
-		pid_t streamPid;
-		if(pipe(streamPipe) || -1 == (streamPid = fork()))
-			return EX_OSERR;
-		if(streamPid) {
-			argv = argv + optind;
-			if(*(argv + 1)) {
-				FILE * stream;
-				if(! (stream = fdopen(streamPipe[1], "w")))
-					return EX_IOERR;
-				close(streamPipe[0]);
-				static char streamBuffer[BUFSIZ];
-				setvbuf(stream, streamBuffer, _IOFBF, sizeof(streamBuffer));
-				do {
-					fputs_unlocked(*argv, stream);
-					if(EOF == putc_unlocked(0, stream))
-						return EX_IOERR;
-				} while(*(++argv));
-				fclose(stream);
-			}
-			else {
-				int streamFd = streamPipe[1];
-				//do {
-					char * str = *argv;
-					size_t size = strlen(str) + 1;
-					ssize_t writeRc;
-					do {
-						if(0 > (writeRc = write(streamFd, str, size)))
-							return EX_IOERR;
-						str += writeRc;
-					} while((size -= writeRc));
-				//} while(*(++argv));
-				close(streamFd);
-			}
-			int status;
-			waitpid(streamPid, &status, 0);
-			return WIFEXITED(status) ? WEXITSTATUS(status) : status + 128;
+		//  Escape the arguments in place, as though they were null terminated strings from stdin
+		opts.flags &= ~PRINTFQ_IGNORE_NULL_INPUT;
+		in.refill = argvRefill;
+		in.handle = argv + optind;
+		if(1 < threads && ! measure && ! (opts.flags & PRINTFQ_FLUSH_ARGUMENTS)) {
+			int error = escapeArguments(&opts, argv + optind, threads);
+			return error ? EILSEQ == error ? EILSEQ : EX_IOERR : 0;
 		}
-		else {
-			close(streamPipe[1]);
-			dup2(streamPipe[0], 0);
-		}
-	}
-	unsigned localeIsNotUtf8;
-	if(! setlocale(LC_ALL, "") || ({
-		char * currentLocale = nl_langinfo(CODESET);
-		//  The ASCII handling is also used with a UTF-8 locale when not escaping
-		// non-printable characters since it is functionally equivalent in that case
-		// and avoids additional conditionals in the UTF-8 handling.
-		(! (localeIsNotUtf8 = strcmp("UTF-8", currentLocale)) && disableCQuoting) ||
-		(localeIsNotUtf8 && ! strcmp("ANSI_X3.4-1968", currentLocale));
-	})) {
-		int c = getc_unlocked(stdin);
-		unsigned isPrintable;
-		if('~' == c) {
-			isPrintable = 1;
-			goto narrowCharStartEscape;
-		}
-		do {
-			if(0 < c) {
-				do {
-					isPrintable = disableCQuoting || isprint(c);
-					if(((unsigned)c < sizeof(shControlChars) && shControlChars[c]) || ! isPrintable) {
-						narrowCharStartEscape:
-						if('\'' == c || ({
-							if(disableCQuoting) {
-								putc_unlocked('\'', stdout);
-								do
-									putc_unlocked(c, stdout);
-								while(0 < (c = getc_unlocked(stdin)) && '\'' != c);
-							}
-							else {
-								fputs_unlocked("$'", stdout);
-								do
-									if(isPrintable)
-										if('\\' == c)
-											fputs_unlocked("\\\\", stdout);
-										else if('\'' == c)
-											fputs_unlocked("\\'", stdout);
-										else
-											putc_unlocked(c, stdout);
-									else if((unsigned)c < ansiEscapesLimit && ansiEscapes[c])
-										printf("\\%c", ansiEscapes[c]);
-									else
-										printf(077 < c || ({
-												//  Peak at the next character.  If it's not a
-												// valid octal digit, print less than 3 digits.
-												int32_t nextc;
-												ungetc((nextc = getc_unlocked(stdin)), stdin);
-												'7' >= nextc && '0' <= nextc;
-											}) ? "\\%.3o" : "\\%o", c
-										);
-								while(0 < (c = getc_unlocked(stdin)) && ({
-									isPrintable = isprint(c);
-									1;
-								}));
-							}
-							putc_unlocked('\'', stdout);
-							'\'' == c;
-						}))
-							fputs_unlocked("\\\'", stdout);
-						else if(0 >= c)
-							break;
-					}
-					else
-						putc_unlocked(c, stdout);
-					c = getc_unlocked(stdin);
-				} while(0 < c);
-			}
-			else
-				fputs_unlocked("''", stdout);
-		} while(0 == c ? (EOF != (c = getc_unlocked(stdin)) ? ({
-					unsigned rc = ignoreNullInput || (
-						nullTerminatedOutput ? EOF != putc_unlocked(0, stdout) && (
-							! flushArguments || EOF != fflush_unlocked(stdout)
-						) : EOF != putc_unlocked(' ', stdout)
-					);
-					if('~' == c && rc) {
-						isPrintable = 1;
-						goto narrowCharStartEscape;
-					}
-					rc;
-				}) : ({
-					if(nullTerminatedOutput)
-						putc_unlocked(0, stdout);
-					0;
-				})
-			) : ({
-				if(ignoreNullInput && nullTerminatedOutput)
-					putc_unlocked(0, stdout);
-				0;
-			})
-		);
-	}
-	else if(localeIsNotUtf8) {
-		//  The locale does not use UTF-8 encoding.  Deference is given to the library
-		// including, unfortunately, its error handling.  This code has not been tested
-		// in MS Windows (would a POSIX shell even work with UTF-16???)
-		wint_t c = getwc_unlocked(stdin);
-		unsigned isPrintable;
-		if(L'~' == c) {
-			isPrintable = 1;
-			goto wideCharStartEscape;
-		}
-		do {
-			if(0 != c && WEOF != c) {
-				do {
-					isPrintable = disableCQuoting || iswprintFn(c);
-					if((c < sizeof(shControlChars) && shControlChars[c]) || ! isPrintable) {
-						wideCharStartEscape:
-						if(L'\'' == c || ({
-							if(disableCQuoting) {
-								putwc_unlocked(L'\'', stdout);
-								do
-									putwc_unlocked(c, stdout);
-								while(0 != (c = getwc_unlocked(stdin)) && WEOF != c && '\'' != c);
-							}
-							else {
-								fputws_unlocked(L"$'", stdout);
-								do {
-									if(isPrintable)
-										if(L'\\' == c)
-											fputws_unlocked(L"\\\\", stdout);
-										else if(L'\'' == c)
-											fputws_unlocked(L"\\'", stdout);
-										else
-											putwc_unlocked(c, stdout);
-									else if(128 > c)
-										if(c < ansiEscapesLimit && ansiEscapes[c])
-											wprintf(L"\\%c", ansiEscapes[c]);
-										else
-											wprintf(077 < c || ({
-													//  Peak at the next code point.  If it's not a
-													// valid octal digit, print less than 3 digits.
-													wint_t nextc;
-													ungetwc((nextc = getwc_unlocked(stdin)), stdin);
-													//  It is technically true that this comparison is
-													// inappropriate when ! defined(__STDC_ISO_10646__)...
-													// but it most likely holds up even then.
-													L'7' >= nextc && L'0' <= nextc;
-												}) ? L"\\%.3o" : L"\\%o", c
-											);
-									else if(! useUnicodeEscapes) {
-										unsigned cbuff[7];
-									#if 1
-										unsigned * cbuffPtr;
-										cbuff[6] = 0;
-										cbuff[5] = (c & 0xBF) | 0x80;
-										if(0x800 > c)
-											*(cbuffPtr = cbuff + 4) = 0xC0 | c >> 6;
-										else {
-											cbuff[4] = (c >> 6 & 0xBF) | 0x80;
-											if(0x10000 > c)
-												*(cbuffPtr = cbuff + 3) = 0xE0 | c >> 12;
-											else {
-												cbuff[3] = (c >> 12 & 0xBF) | 0x80;
-												if(0x200000 > c)
-													*(cbuffPtr = cbuff + 2) = 0xF0 | c >> 18;
-												else {
-													cbuff[2] = (c >> 18 & 0xBF) | 0x80;
-													if(0x4000000 > c)
-														*(cbuffPtr = cbuff + 1) = 0xF8 | c >> 24;
-													else {
-														cbuff[1] = (c >> 24 & 0xBF) | 0x80;
-														*(cbuffPtr = cbuff) = 0xFC | (c >= 0x40000000);
-													}
-												}
-											}
-										}
-									#else
-										unsigned * cbuffPtr = cbuff;
-										if(0x800 > c) {
-											*cbuff = 0xC0 | c >> 6;
-											cbuff[1] = (c & 0xBF) | 0x80;
-											cbuff[2] = 0;
-										}
-										else if(0x10000 > c) {
-											*cbuff = 0xE0 | c >> 12;
-											cbuff[1] = (c >> 6 & 0xBF) | 0x80;
-											cbuff[2] = (c & 0x3F) | 0x80;
-											cbuff[3] = 0;
-										}
-										else if(0x200000 > c) {
-											*cbuff = 0xF0 | c >> 18;
-											cbuff[1] = (c >> 12 & 0xBF) | 0x80;
-											cbuff[2] = (c >> 6 & 0xBF) | 0x80;
-											cbuff[3] = (c & 0xBF) | 0x80;
-											cbuff[4] = 0;
-										}
-										else if(0x4000000 > c) {
-											*cbuff = 0xF8 | c >> 24;
-											cbuff[1] = (c >> 18 & 0xBF) | 0x80;
-											cbuff[2] = (c >> 12 & 0xBF) | 0x80;
-											cbuff[3] = (c >> 6 & 0xBF) | 0x80;
-											cbuff[4] = (c & 0xBF) | 0x80;
-											cbuff[5] = 0;
-										}
-										else {
-											*cbuff = 0xFC | (c >= 0x40000000);
-											cbuff[1] = (c >> 24 & 0xBF) | 0x80;
-											cbuff[2] = (c >> 18 & 0xBF) | 0x80;
-											cbuff[3] = (c >> 12 & 0xBF) | 0x80;
-											cbuff[4] = (c >> 6 & 0xBF) | 0x80;
-											cbuff[5] = (c & 0xBF) | 0x80;
-											cbuff[6] = 0;
-										}
-									#endif
-										do
-											wprintf(L"\\%.3o", *cbuffPtr);
-										while(*(++cbuffPtr));
-									}
-									else if(sizeof(wchar_t) > 2)
-										if(65535 >= c)
-											wprintf(0xFFF < c || ({
-													wint_t nextc;
-													ungetwc((nextc = getwc_unlocked(stdin)), stdin);
-													iswxdigit(nextc);
-												}) ? L"\\u%.4X" : L"\\u%X", c
-											);
-										else {
-											//  In hopes of it taking less output glyphs,
-											// only output as many UTF digits as are needed.
-											// Terminate the quoting if it is followed by a
-											// character that would be interpreted as a hex digit.
-											wprintf(L"\\U%X", c);
-											wint_t nextc;
-											ungetwc((nextc = getwc_unlocked(stdin)), stdin);
-											if(iswxdigit(nextc))
-												break;
-										}
-									else
-										wprintf(0xFFF < c || ({
-												wint_t nextc;
-												ungetwc((nextc = getwc_unlocked(stdin)), stdin);
-												iswxdigit(nextc);
-											}) ? L"\\u%.4X" : L"\\u%X", c
-										);
-								}
-								while(0 != (c = getwc_unlocked(stdin)) && WEOF != c && ({
-									isPrintable = iswprintFn(c);
-									1;
-								}));
-							}
-							putwc_unlocked(L'\'', stdout);
-							L'\'' == c;
-						}))
-							fputws_unlocked(L"\\\'", stdout);
-						else if(0 == c || WEOF == c)
-							break;
-					}
-					else
-						putwc_unlocked(c, stdout);
-					c = getwc_unlocked(stdin);
-				} while(0 != c && WEOF != c);
-			}
-			else
-				fputws_unlocked(L"''", stdout);
-		} while(0 == c ? (WEOF != (c = getwc_unlocked(stdin)) ? ({
-					unsigned lc = ignoreNullInput || (
-						nullTerminatedOutput ? WEOF != putwc_unlocked(L'\000', stdout) && (
-							! flushArguments || EOF != fflush_unlocked(stdout)
-						) : (WEOF != c && WEOF != putwc_unlocked(L' ', stdout))
-					);
-					if(L'~' == c && lc) {
-						isPrintable = 1;
-						goto wideCharStartEscape;
-					}
-					lc;
-				}) : ({
-					if(nullTerminatedOutput)
-						putwc_unlocked(0, stdout);
-					0;
-				})
-			) : ({
-				if(ignoreNullInput && nullTerminatedOutput)
-					putwc_unlocked(0, stdout);
-				0;
-			})
-		);
-		if(EILSEQ == errno)
-			return EILSEQ;
 	}
 	else {
-		//  The locale uses UTF-8 encoding
-		//  It is apparently impossible to recover after a decoding error with getwc()
-		// without closing the stream and losing input.  clearerr() and fflush() do
-		// nothing to recover from a decoding error.  The next alternative is using a
-		// regular byte oriented stream and the library's wide string conversion
-		// functions, but recovering from errors with the conversion function requires
-		// digging into the opaque mbstate_t object.  Hence getUtf8CodePoint(), so that
-		// unrecognized characters can be pushed to the output without loss.
-		//  When there is no error, getUtf8CodePoint() returns the next code point in the
-		// stream.  cbuff and bytesInCodePoint are additional return values.
-		//  Starting at index 0 of cbuff, bytesInCodePoint indicates how many bytes are
-		// used by the returned code point.  This is set to zero if an encoding error or
-		// EOF are detected, in which cases the values stored in cbuff should not be used.
-		// When byteInCodePoint is 0, the return code will be the return code from getc()
-		// at the location of the error.
-		unsigned bytesInCodePoint;
-		//  This buffer is intended for use by the caller for outputting raw UTF-8 w/o
-		// coverting the code point back to UTF-8.
-		unsigned char cbuff[4];
-		//  getUtf8Buff and getUtf8BuffLength are used for internal tracking by
-		// getUtf8CodePoint() between calls.
-		int32_t getUtf8Buff[4];
-		//  getUtf8BuffLength indicates how many addtional bytes have been read past the
-		// returned code point or byte
-		unsigned getUtf8BuffLength = 0;
-		int32_t getUtf8CodePoint(void)
-		{
-			int32_t rc;
-			if(! getUtf8BuffLength)
-				*getUtf8Buff = getc_unlocked(stdin);
-			if(-1 < *getUtf8Buff) {
-				if(*getUtf8Buff & 0x80) {
-					//  If getUtf8Buff[0]'s hsb-1 is not also set, it's invalid encoding.
-					if(*getUtf8Buff & 0x40) {
-						//  At least two characters are expected
-						//int expectedBytes = c1 & 0x20 ? (c1 & 0x10 ? 4 : 3) : 2;
-						if(2 > getUtf8BuffLength)
-							getUtf8Buff[1] = getc_unlocked(stdin);
-						if(*getUtf8Buff & 0x20) {
-							//  At least 3 characters are expected
-							if(3 > getUtf8BuffLength)
-								getUtf8Buff[2] = getc_unlocked(stdin);
-							if(*getUtf8Buff & 0x10) {
-								if(! (*getUtf8Buff & 0x8)) {
-									//  Exactly 4 characters are expected
-									if(4 > getUtf8BuffLength)
-										getUtf8Buff[3] = getc_unlocked(stdin);
-									//  This condition will be false if getUtf8Buff[3] == EOF
-									if((getUtf8Buff[3] & 0xC0) == 0x80) {
-										rc = (int32_t)(*getUtf8Buff & 0x07) << 18
-										| (int32_t)(getUtf8Buff[1] & 0x3F) << 12
-										| (int32_t)(getUtf8Buff[2] & 0x3F) << 6
-										| (int32_t)(getUtf8Buff[3] & 0x3F);
-										//int32_t rcAndFFFF;
-										if(0xFFFF < rc
-											//  Code points > 0x10FFFF are invalid.
-											&& 0x110000 > rc
-											// Noncharacters are permissible.
-											//&& 0xFFFF != (rcAndFFFF = rc & 0xFFFF)
-											//&& 0xFFFE != rcAndFFFF
-										) {
-											bytesInCodePoint = 4;
-											getUtf8BuffLength = 0;
-											goto setCbuff3;
-										}
-									}
-									getUtf8BuffLength = 4;
-								}
-							}
-							else {
-								//  Exactly 3 characters are expected
-								//  This condition will be false if getUtf8Buff[2] == EOF
-								if((getUtf8Buff[2] & 0xC0) == 0x80)
-								{
-									rc = (int32_t)(*getUtf8Buff & 0x0F) << 12
-									| (int32_t)(getUtf8Buff[1] & 0x3F) << 6
-									| (int32_t)(getUtf8Buff[2] & 0x3F);
-									// 0x10000 > rc is guaranteed by the bit handling
-									if(0x7FF < rc
-										// Disallow UTF-16 surrogates
-										&& (0xD800 > rc || 0xDFFF < rc)
-										// Noncharacters are permissible.
-										//&& (0xFDD0 > rc || 0xFDEF < rc) && 0xFFFE > rc
-									) {
-										bytesInCodePoint = 3;
-										getUtf8BuffLength = getUtf8BuffLength > 3;
-										goto setCbuff2;
-									}
-								}
-							}
-							if(3 > getUtf8BuffLength)
-								getUtf8BuffLength = 3;
-						}
-						else {
-							//  Exactly two characters are expected
-							//  This condition will be false if getUtf8Buff[1] == EOF
-							if((getUtf8Buff[1] & 0xC0) == 0x80 &&
-								0x7F < (rc = (int32_t)(*getUtf8Buff & 0x1F) << 6 | (int32_t)(getUtf8Buff[1] & 0x3F))
-								// 0x800 > rc is guaranteed by the bit handling
-							) {
-								bytesInCodePoint = 2;
-								if(1 < getUtf8BuffLength)
-									getUtf8BuffLength -= 2;
-								else
-									getUtf8BuffLength = 0;
-								goto setCbuff1;
-							}
-							if(2 > getUtf8BuffLength)
-								getUtf8BuffLength = 2;
-						}
-					}
-					bytesInCodePoint = 0;
-				}
-				else {
-					bytesInCodePoint = 1;
-					*cbuff = *getUtf8Buff;
-				}
-			}
-			else
-				bytesInCodePoint = 0;
-			rc = *getUtf8Buff;
-			if(getUtf8BuffLength && --getUtf8BuffLength)
-				memmove(getUtf8Buff, getUtf8Buff + 1, sizeof(int32_t) * getUtf8BuffLength);
-			return rc;
-		setCbuff3:
-			cbuff[3] = getUtf8Buff[3];
-		setCbuff2:
-			cbuff[2] = getUtf8Buff[2];
-		setCbuff1:
-			cbuff[1] = getUtf8Buff[1];
-			*cbuff = *getUtf8Buff;
-			//  For the size of this buffer, there's little value in tracking the start index.
-			// Shift it to begin at the zero index.
-			if(getUtf8BuffLength)
-				memmove(getUtf8Buff, getUtf8Buff + bytesInCodePoint, sizeof(int32_t) * getUtf8BuffLength);
-			return rc;
-		}
-		void ungetUtf8CodePoint(int32_t uc)
-		{
-			if(bytesInCodePoint) {
-				if(getUtf8BuffLength)
-					memmove(getUtf8Buff + bytesInCodePoint, getUtf8Buff, sizeof(int32_t) * getUtf8BuffLength);
-				getUtf8BuffLength += bytesInCodePoint;
-				do {
-					--bytesInCodePoint;
-					getUtf8Buff[bytesInCodePoint] = (unsigned char )cbuff[bytesInCodePoint];
-				}
-				while(bytesInCodePoint);
+		if(inputFile && 0 > (inputFd = open(inputFile, O_RDONLY))) {
+			fprintf(stderr, "printfq: %s: %s\n", inputFile, strerror(errno));
+			return EX_NOINPUT;
+		}
+		//  All of the input is one string with --ignore-null-input.  Otherwise, a shard's strings
+		// are found in the mapped input, and are only part of it, which --resume would not find
+		// again.
+		if(opts.flags & PRINTFQ_IGNORE_NULL_INPUT)
+			shards = 0;
+		if(shards)
+			ioUring = 0;
+		if(checkpointPath && ! measure && ! shards) {
+			int rc;
+			if(0 > (checkpointFd = open(checkpointPath, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0666))) {
+				fprintf(stderr, "printfq: %s: %s\n", checkpointPath, strerror(errno));
+				return EX_CANTCREAT;
 			}
-			else {
-				//  This can lose valid input if called repeatedly.  Permitting a fifth character
-				// in getUtf8Buff, which could only be populated as the result of an unget, would
-				// avoid this.
-				if(! getUtf8BuffLength)
-					getUtf8BuffLength = 1;
-				else if(4 > getUtf8BuffLength)
-					memmove(getUtf8Buff + 1, getUtf8Buff, sizeof(int32_t) * (getUtf8BuffLength++));
-				*getUtf8Buff = uc;
+			if((rc = startCheckpoint(resume)))
+				return rc;
+			//  As with --index
+			threads = 1;
+			ioUring = 0;
+		}
+		//  Stream pipes, terminals, and anything else that cannot be mapped, and everything with
+		// --io=uring in case it falls back to reads
+		if((ioUring || mapInput(&in)) && ! (inputBuffer = malloc(bufferSize))) {
+			perror("printfq");
+			return EX_OSERR;
+		}
+		if(shards) {
+			struct stat st;
+			off_t offset = lseek(inputFd, 0, SEEK_CUR);
+			if(in.refill && (fstat(inputFd, &st) || ! S_ISREG(st.st_mode) || 0 > offset ||
+				offset < st.st_size))
+			{
+				fputs("printfq: --shard requires a regular file as input\n", stderr);
+				return EX_USAGE;
 			}
+			//  An empty shard has no output, unless the input is empty, in which case the first
+			// shard escapes it
+			if(in.refill ? 1 != shard : 0 > (shardDelimit = shardInput(&in, shard, shards,
+				! (opts.flags & PRINTFQ_NULL_TERMINATED_OUTPUT))))
+				return closeIndex(measure && 0 > puts("0") ? EX_IOERR : 0);
 		}
-		int32_t c = getUtf8CodePoint();
-		unsigned isPrintable;
-		if('~' == c) {
-			isPrintable = 1;
-			goto utf8StartEscape;
-		}
-		do {
-			if(0 < c) {
-				do {
-					//  Except when c <= 0, which has been ruled out, c will always be > 127
-					// when bytesInCodePoint is 0
-					if(! (isPrintable = bytesInCodePoint && iswprintFn((wint_t)c))
-						|| ((uint32_t)c < sizeof(shControlChars) && shControlChars[c])
-					) {
-						if('\'' == c)
-							fputs_unlocked("\\\'", stdout);
-						else {
-							utf8StartEscape:
-							fputs_unlocked("$'", stdout);
-							do {
-								if(isPrintable)
-									if('\\' == c)
-										fputs_unlocked("\\\\", stdout);
-									else if('\'' == c)
-										fputs_unlocked("\\'", stdout);
-									else if(bytesInCodePoint)
-										fwrite_unlocked(cbuff, bytesInCodePoint, 1, stdout);
-									else
-										putc_unlocked(c, stdout);
-								//  c will be in the range of 128 - 255 when ! bytesInCodePoint,
-								// but there are valid code points in that range too
-								else if(128 > c || ! bytesInCodePoint)
-									if((uint32_t)c < ansiEscapesLimit && ansiEscapes[c])
-										printf("\\%c", ansiEscapes[c]);
-									else
-										printf(077 < c || ({
-												//  Peak at the next code point.  If it's not a
-												// valid octal digit, print less than 3 digits.
-												int32_t nextc;
-												ungetUtf8CodePoint((nextc = getUtf8CodePoint()));
-												'7' >= nextc && '0' <= nextc;
-											}) ? "\\%.3o" : "\\%o", c
-										);
-								else if(! useUnicodeEscapes)
-									//  Optimization is not possible in this case
-									// since all bytes are > 127
-									for(unsigned idx = 0; idx < bytesInCodePoint; idx++)
-										printf("\\%.3o", (unsigned char)cbuff[idx]);
-								else if(65535 >= c)
-									printf(0xFFF < c || ({
-											int32_t nextc;
-											ungetUtf8CodePoint((nextc = getUtf8CodePoint()));
-											nextc <= 'f' && isxdigit((wint_t)nextc);
-										}) ? "\\u%.4X" : "\\u%X", c
-									);
-								else {
-									//  In hopes of it taking less output glyphs,
-									// only output as many UTF digits as are needed.
-									// Terminate the quoting if it is followed by a
-									// character that would be interpreted as a hex digit.
-									printf("\\U%X", c);
-									int32_t nextc;
-									ungetUtf8CodePoint((nextc = getUtf8CodePoint()));
-									if(nextc <= 'f' && isxdigit((wint_t)nextc))
-										break;
-								}
-							}
-							while(0 < (c = getUtf8CodePoint()) && ({
-								isPrintable = bytesInCodePoint && iswprintFn((wint_t)c);
-								1;
-							}));
-							putc_unlocked('\'', stdout);
-							if(0 >= c)
-								break;
-						}
-					}
-					else
-						fwrite_unlocked(cbuff, bytesInCodePoint, 1, stdout);
-					c = getUtf8CodePoint();
-				}
-				while(0 < c);
+		if(1 < threads && ! measure && ! ioUring && ! flushIdle && ! flushDelay && ! flushSize &&
+			! (opts.flags & (PRINTFQ_FLUSH_ARGUMENTS | PRINTFQ_IGNORE_NULL_INPUT)))
+		{
+			int error = escapeParallel(&opts, &in, threads);
+			if(! error && shardDelimit && writeShardDelimiter())
+				error = errno;
+			return error ? EILSEQ == error ? EILSEQ : EX_IOERR : 0;
+		}
+		//  Escaping would output an empty string if nothing follows the checkpoint
+		if(resumed && in.pos == in.end) {
+			ssize_t rc = in.refill(&in);
+			if(0 > rc) {
+				perror("printfq");
+				return closeIndex(EX_IOERR);
 			}
-			else
-				fputs_unlocked("''", stdout);
-		} while(0 == c ? (EOF != (c = getUtf8CodePoint()) ? ({
-					unsigned lc = ignoreNullInput || (
-						nullTerminatedOutput ? EOF != putc_unlocked(0, stdout) && (
-							! flushArguments || EOF != fflush_unlocked(stdout)
-						) : EOF != putc_unlocked(' ', stdout)
-					);
-					if('~' == c && lc) {
-						isPrintable = 1;
-						goto utf8StartEscape;
-					}
-					lc;
-				}) : ({
-					if(nullTerminatedOutput)
-						putc_unlocked(0, stdout);
-					0;
-				})
-			) : ({
-				if(ignoreNullInput && nullTerminatedOutput)
-					putc_unlocked(0, stdout);
-				0;
-			})
-		);
+			if(! rc)
+				return closeIndex(0);
+		}
 	}
-	return 0;
+	if(measure) {
+		char scratch[4096];
+		printfq_output out = {
+			.buf = scratch,
+			.pos = scratch,
+			.end = scratch + sizeof(scratch),
+			.flush = measureFlush,
+			.write = measureWrite,
+			.record = indexFile || 0 <= checkpointFd ? recordString : NULL
+		};
+		int rc = transform(&opts, &in, &out);
+		addStats(&out.stats);
+		outputBytes = measuredLength += ! rc && shardDelimit;
+		printf("%zu\n", measuredLength);
+		if(rc)
+			return closeIndex(EILSEQ == errno ? EILSEQ : EX_IOERR);
+		return closeIndex(fflush(stdout) ? EX_IOERR : 0);
+	}
+	char * stdoutBuffer = malloc(bufferSize);
+	if(! stdoutBuffer) {
+		perror("printfq");
+		return EX_OSERR;
+	}
+	printfq_output out = {
+		.buf = stdoutBuffer,
+		.pos = stdoutBuffer,
+		.end = stdoutBuffer + (flushSize && flushSize < bufferSize ? flushSize : bufferSize),
+		.flush = stdoutFlush,
+		.write = stdoutWrite,
+		.record = indexFile || 0 <= checkpointFd ? recordString : NULL
+	};
+	if(flushIdle || flushDelay)
+		policyOutput = &out;
+	#ifdef PRINTFQ_URING
+		//  Fall back to reads and writes when the kernel does not support io_uring
+		ioUring = ioUring && ! policyOutput && inputRefill == in.refill && ! uringInit(&in, &out);
+	#endif
+	int rc = transform(&opts, &in, &out);
+	#ifdef PRINTFQ_URING
+		if(ioUring && uringFinish() && ! rc)
+			rc = -1;
+	#endif
+	addStats(&out.stats);
+	if(rc)
+		return closeIndex(EILSEQ == errno ? EILSEQ : EX_IOERR);
+	if(shardDelimit && writeShardDelimiter())
+		return closeIndex(EX_IOERR);
+	if(0 <= checkpointFd && writeCheckpoint(inputBytes - (in.end - in.pos), outputBytes)) {
+		perror("printfq: checkpoint");
+		return closeIndex(EX_IOERR);
+	}
+	return closeIndex(0);
 }
@@ -0,0 +1,220 @@
+//  printfq.h
+//  Library interface to the printfq escaping engines.  The same engines are used by the printfq
+// command, which is a thin wrapper around printfq_escape_stream().
+//  Input is processed exactly as the printfq command processes a stream on stdin:  null
+// characters separate the input into strings, each of which is individually escaped and
+// delimited in the output according to the option flags.  Input without a null character is a
+// single string.
+
+#ifndef PRINTFQ_H
+#define PRINTFQ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Option flags.  Each corresponds to the printfq command line option of the same name.
+#define PRINTFQ_ESCAPE_MORE            0x01 // -e
+#define PRINTFQ_FLUSH_ARGUMENTS        0x02 // -f, without the implied -z
+#define PRINTFQ_ESCAPE_INVISIBLE       0x04 // -i
+#define PRINTFQ_MINIMAL                0x08 // -m
+#define PRINTFQ_IGNORE_NULL_INPUT      0x10 // -n
+#define PRINTFQ_UNICODE_ESCAPES        0x20 // -u
+#define PRINTFQ_NULL_TERMINATED_OUTPUT 0x40 // -z
+#define PRINTFQ_OPTIMIZE_OUTPUT_LENGTH 0x80 // -o, only with PRINTFQ_CHARSET_ASCII and UTF8
+
+//  Character set handling.  ASCII is used for the C locale, UTF-8 is decoded internally, and
+// anything else is decoded by the C library according to the current LC_CTYPE locale.  Single
+// byte character sets, such as ISO-8859-1, are decoded through a table of the locale's
+// characters that is built the first time it is needed.
+#define PRINTFQ_CHARSET_ASCII       0
+#define PRINTFQ_CHARSET_UTF8        1
+#define PRINTFQ_CHARSET_LOCALE      2
+#define PRINTFQ_CHARSET_SINGLE_BYTE 3
+
+typedef struct printfq_opts {
+	unsigned flags;
+	unsigned charset;
+} printfq_opts;
+
+//  Initialize opts with the given option flags and the character set of the current LC_CTYPE
+// locale.  setlocale() should already have been called.  Which characters are printable is also
+// decided by the locale of the last call, except that PRINTFQ_STATIC_CLASSES builds decide it for
+// UTF-8 from tables generated from a UTF-8 locale at build time.  Returns 0.
+int printfq_opts_init(printfq_opts * opts, unsigned flags);
+
+//  An input source.  The engines read from pos until it reaches end, then call refill.  refill
+// may also be called before pos reaches end when a multibyte sequence is split across the end
+// of the input, in which case the bytes between pos and end must remain in front of the new
+// input.  refill must return the number of bytes added between pos and end, or return 0 at
+// the end of the input or -1 with errno set on error.  refill may be NULL for input that is
+// entirely in memory.  error is set by the library to the errno value from a failed refill.
+typedef struct printfq_input {
+	const unsigned char * pos;
+	const unsigned char * end;
+	ssize_t (* refill)(struct printfq_input * in);
+	void * handle;
+	int error;
+} printfq_input;
+
+//  Counters that the library keeps while escaping to an output sink.  They are only ever added
+// to, so they may be zeroed, read, or summed across outputs at any time between calls.  Input
+// that cannot be decoded at its very start, for which only '' is output, is not counted in
+// strings, and record is not called for it.  invalidBytes counts the improperly encoded bytes
+// that are escaped with PRINTFQ_CHARSET_UTF8.  It stays 0 with PRINTFQ_MINIMAL, which copies such
+// bytes into the output without decoding them, and in the other character sets.
+typedef struct printfq_stats {
+	size_t strings;              // strings escaped
+	size_t flushes;              // calls to flush and write
+	size_t writtenBytes;         // bytes consumed by flush and write
+	size_t quotedSegments;       // '' and $'' quoted segments
+	size_t quotedBytes;          // output bytes in those segments, including the quotes
+	size_t octalEscapes;
+	size_t unicodeEscapes;       // \u
+	size_t longUnicodeEscapes;   // \U
+	size_t ansiEscapes;          // \n, \t, \E, and the like
+	size_t invalidBytes;         // bytes of invalid UTF-8, as above
+} printfq_stats;
+
+//  An output sink.  The engines write to pos until it reaches end, then call flush.  flush must
+// make room for more output, normally by consuming the bytes between buf and pos and resetting
+// pos, and return 0, or return -1 with errno set on error.  flush is also called between strings
+// with PRINTFQ_FLUSH_ARGUMENTS and before printfq_escape_stream() returns.  write is optional.
+// When it is set, a block of output that is at least half the size of the buffer and does not
+// fit in it is passed to write instead of being copied in pieces.  write must then consume the
+// bytes between buf and pos followed by the size bytes at ptr, reset pos, and return 0, or
+// return -1 with errno set.  error is set by the library to the errno value from a failed flush
+// or write.  stats should start zeroed and is updated by the library.  record is also optional.
+// When it is set, it is called at the end of each string, after its output and before its
+// delimiter, with in->pos just past the string and its null terminator, if any.  The string's
+// output ends stats.writtenBytes + (pos - buf) bytes into the output.
+typedef struct printfq_output {
+	char * buf;
+	char * pos;
+	char * end;
+	int (* flush)(struct printfq_output * out);
+	int (* write)(struct printfq_output * out, const void * ptr, size_t size);
+	void * handle;
+	int error;
+	printfq_stats stats;
+	void (* record)(struct printfq_output * out, const struct printfq_input * in);
+} printfq_output;
+
+//  Escape everything from in to out.  Returns 0 on success, or -1 with errno set.  errno is
+// EILSEQ when input could not be decoded in a PRINTFQ_CHARSET_LOCALE character set, in which
+// case the output is terminated as though the input ended at that point.
+int printfq_escape_stream(const printfq_opts * opts, printfq_input * in, printfq_output * out);
+
+//  Escape len bytes from in into the cap bytes at out.  The return value is the full length of
+// the escaped output, which may exceed cap, in which case only the first cap bytes are
+// written.  The output is not null terminated unless that is part of the escaped output.
+// (size_t)-1 is returned with errno set on error, as with printfq_escape_stream().
+size_t printfq_escape(const char * in, size_t len, char * out, size_t cap, const printfq_opts * opts);
+
+//  Return the length of the escaped output for len bytes from in, as printfq_escape() does, but
+// without writing it anywhere.  A buffer of that size can then be filled by printfq_escape() in
+// a single pass.  (size_t)-1 is returned with errno set on error.
+size_t printfq_escaped_length(const char * in, size_t len, const printfq_opts * opts);
+
+//  A string to escape, and where its escaped output was placed in an arena
+typedef struct printfq_string {
+	const char * ptr;
+	size_t len;
+} printfq_string;
+
+typedef struct printfq_span {
+	size_t offset;
+	size_t length;
+} printfq_span;
+
+//  Escape each of count strings as printfq_escape() would, one after another into the *cap bytes
+// at *arena, and set the offset and length of each output in spans.  When the arena fills, it is
+// grown with realloc() and *arena and *cap are updated, so *arena must have come from malloc(),
+// or may be NULL with *cap 0.  The arena may then be reused for the next batch.  The return
+// value is the number of bytes used in the arena.  (size_t)-1 is returned with errno set on
+// error, in which case the arena remains valid but its contents and spans are incomplete.
+size_t printfq_escape_batch(const printfq_string * strings, size_t count, printfq_span * spans,
+	char ** arena, size_t * cap, const printfq_opts * opts);
+
+//  A bounded cache of escaped output, keyed by the input and the options.  When it is full, the
+// entries that have gone the longest without a hit are evicted first.  A cache may only be used
+// by one thread at a time, and with one locale.
+typedef struct printfq_cache printfq_cache;
+
+//  Counters that a cache keeps, which are only ever added to
+typedef struct printfq_cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+} printfq_cache_stats;
+
+//  Create a cache that holds up to size bytes of input and output.  Returns NULL with errno set on
+// error.
+printfq_cache * printfq_cache_new(size_t size);
+
+void printfq_cache_free(printfq_cache * cache);
+
+const printfq_cache_stats * printfq_cache_get_stats(const printfq_cache * cache);
+
+//  Return the cached output for len bytes from in with opts, and set *outLen to its length, or
+// return NULL if it is not cached.  The output remains valid until the next insertion.
+const char * printfq_cache_lookup(printfq_cache * cache, const char * in, size_t len,
+	const printfq_opts * opts, size_t * outLen);
+
+//  Add the outLen bytes at out as the output for len bytes from in with opts, evicting other
+// entries as needed.  Output that would take more than a quarter of the cache is not added.
+// Returns 0, or -1 with errno set on error.
+int printfq_cache_insert(printfq_cache * cache, const char * in, size_t len,
+	const printfq_opts * opts, const char * out, size_t outLen);
+
+//  printfq_escape_batch(), except that strings found in cache are copied from it instead of
+// being escaped again, and the others are added to it.  cache may be NULL.
+size_t printfq_escape_batch_cached(const printfq_string * strings, size_t count,
+	printfq_span * spans, char ** arena, size_t * cap, const printfq_opts * opts,
+	printfq_cache * cache);
+
+//  Decode the output of printfq, or of the escaping functions, from in to out.  The input is
+// split into words at unquoted spaces, tabs, newlines, and null characters, as a shell would
+// split it, and each word is output followed by a null character.  Only the quoting and escapes
+// that printfq emits are accepted:  bare characters, a backslash before a character, '' quoting,
+// and $'' quoting with \\, \', the ANSI-C letter escapes, octal escapes of 1 to 3 digits, and \u
+// and \U escapes.  Those are output in the character set of opts.  PRINTFQ_FLUSH_ARGUMENTS in
+// opts flushes out after each word, and the other flags are ignored.  Returns 0 on success, or
+// -1 with errno set.  errno is EILSEQ when the input is not in that form, or ends inside quotes,
+// in which case the output ends at that point, without a terminator for the word in progress.
+int printfq_decode_stream(const printfq_opts * opts, printfq_input * in, printfq_output * out);
+
+//  Decode len bytes from in into the cap bytes at out, with the same return value as
+// printfq_escape()
+size_t printfq_decode(const char * in, size_t len, char * out, size_t cap, const printfq_opts * opts);
+
+#ifdef PRINTFQ_TRACE
+//  Timing that a library built with PRINTFQ_TRACE keeps across all calls to
+// printfq_escape_stream() and printfq_decode_stream(), and so to the functions built on them, in
+// nanoseconds.  stringNs is a histogram of the time from the start of each string to its end,
+// where bucket i counts strings that took from 2^i up to 2^(i+1) nanoseconds, and the last bucket
+// also counts any that took longer.
+#define PRINTFQ_TRACE_BUCKETS 32
+
+typedef struct printfq_trace {
+	unsigned long long calls;
+	unsigned long long totalNs;
+	unsigned long long readNs;     // in refill
+	unsigned long long writeNs;    // in flush and write
+	unsigned long long classifyNs; // building the bitmap of printable and invisible characters
+	unsigned long long strings;
+	unsigned long long stringNs[PRINTFQ_TRACE_BUCKETS];
+} printfq_trace;
+
+//  Copy the totals so far into trace
+void printfq_trace_get(printfq_trace * trace);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif